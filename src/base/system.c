@@ -24,6 +24,7 @@
 	#include <netinet/in.h>
 	#include <fcntl.h>
 	#include <pthread.h>
+	#include <sys/mman.h>
 	#include <arpa/inet.h>
 
 	#include <dirent.h>
@@ -38,6 +39,7 @@
 	#include <winsock2.h>
 	#include <ws2tcpip.h>
 	#include <fcntl.h>
+	#include <io.h>
 	#include <direct.h>
 	#include <errno.h>
 	#include <process.h>
@@ -379,6 +381,37 @@ unsigned io_read(IOHANDLE io, void *buffer, unsigned size)
 	return fread(buffer, 1, size, (FILE*)io);
 }
 
+unsigned io_read_at(IOHANDLE io, void *buffer, unsigned size, unsigned offset)
+{
+	unsigned total = 0;
+#if defined(CONF_FAMILY_WINDOWS)
+	/* reading with an offset still moves the file pointer of a synchronous handle */
+	HANDLE file = (HANDLE)_get_osfhandle(_fileno((FILE*)io));
+	while(total < size)
+	{
+		OVERLAPPED overlapped;
+		DWORD bytes;
+		mem_zero(&overlapped, sizeof(overlapped));
+		overlapped.Offset = offset + total;
+		if(!ReadFile(file, (char *)buffer + total, size - total, &bytes, &overlapped) || bytes == 0)
+			break;
+		total += bytes;
+	}
+#else
+	int fd = fileno((FILE*)io);
+	while(total < size)
+	{
+		ssize_t bytes = pread(fd, (char *)buffer + total, size - total, (off_t)offset + total);
+		if(bytes < 0 && errno == EINTR)
+			continue;
+		if(bytes <= 0)
+			break;
+		total += bytes;
+	}
+#endif
+	return total;
+}
+
 void io_read_all(IOHANDLE io, void **result, unsigned *result_len)
 {
 	unsigned char *buffer = malloc(1024);
@@ -495,6 +528,53 @@ int io_flush(IOHANDLE io)
 	return 0;
 }
 
+void *io_map(IOHANDLE io, unsigned *size)
+{
+#if defined(CONF_FAMILY_WINDOWS)
+	HANDLE file = (HANDLE)_get_osfhandle(_fileno((FILE*)io));
+	LARGE_INTEGER length;
+	HANDLE mapping;
+	void *data;
+
+	*size = 0;
+	if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length) || length.QuadPart <= 0 || length.QuadPart > 0x7fffffff)
+		return 0;
+	mapping = CreateFileMappingW(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if(!mapping)
+		return 0;
+	data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping); // the view keeps the mapping alive
+	if(!data)
+		return 0;
+	*size = (unsigned)length.QuadPart;
+	return data;
+#else
+	int fd = fileno((FILE*)io);
+	struct stat sb;
+	void *data;
+
+	*size = 0;
+	if(fstat(fd, &sb) != 0 || sb.st_size <= 0 || sb.st_size > 0x7fffffff)
+		return 0;
+	data = mmap(0, sb.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED)
+		return 0;
+	*size = (unsigned)sb.st_size;
+	return data;
+#endif
+}
+
+void io_unmap(void *data, unsigned size)
+{
+	if(!data)
+		return;
+#if defined(CONF_FAMILY_WINDOWS)
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
+
 struct THREAD_RUN
 {
 	void (*threadfunc)(void *);
@@ -220,6 +220,27 @@ IOHANDLE io_open(const char *filename, int flags);
 */
 unsigned io_read(IOHANDLE io, void *buffer, unsigned size);
 
+/*
+	Function: io_read_at
+		Reads data into a buffer from a given position in a file.
+
+	Parameters:
+		io - Handle to the file to read data from.
+		buffer - Pointer to the buffer that will receive the data.
+		size - Number of bytes to read from the file.
+		offset - Position in the file to start reading at.
+
+	Returns:
+		Number of bytes read.
+
+	Remarks:
+		- Several threads can read from the same handle at once.
+		- Reads the file directly, past the buffer of io_read. On windows
+		it also moves the position of the underlying file, so the handle
+		must not be used with io_read, io_skip or io_seek afterwards.
+*/
+unsigned io_read_at(IOHANDLE io, void *buffer, unsigned size, unsigned offset);
+
 /*
 	Function: io_read_all
 		Reads the rest of the file into a buffer.
@@ -370,6 +391,36 @@ int io_close(IOHANDLE io);
 */
 int io_flush(IOHANDLE io);
 
+/*
+	Function: io_map
+		Maps the complete contents of a file into memory.
+
+	Parameters:
+		io - Handle to the file, must be opened for reading.
+		size - Receives the size of the mapping in bytes.
+
+	Returns:
+		Returns a pointer to the mapped contents or 0 on failure.
+
+	Remarks:
+		- The mapping is private and copy-on-write, modifications are
+		never written back to the file.
+		- The mapping stays valid after the file has been closed.
+		- Empty files and files larger than 2 GiB can't be mapped.
+		- The mapping must be released with <io_unmap>.
+*/
+void *io_map(IOHANDLE io, unsigned *size);
+
+/*
+	Function: io_unmap
+		Releases a mapping created by <io_map>.
+
+	Parameters:
+		data - Pointer returned by <io_map>.
+		size - Size of the mapping as returned by <io_map>.
+*/
+void io_unmap(void *data, unsigned size);
+
 
 /*
 	Function: io_stdin
@@ -49,7 +49,7 @@ R partition_binary(R range, T value)
 	{
 		unsigned pivot = (range.size()-1)/2;
 		if(range.index(pivot) < value)
-			range = range.slice(pivot+1, range.size()-1);
+			range = range.slice(pivot+1, range.size()-1-pivot);
 		else
 			range = range.slice(0, pivot+1);
 	}
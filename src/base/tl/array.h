@@ -198,7 +198,7 @@ public:
 
 		list[index] = item;
 
-		return num_elements-1;
+		return index;
 	}
 
 	/*
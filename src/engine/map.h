@@ -13,7 +13,13 @@ public:
 	virtual void *GetData(int Index) = 0;
 	virtual void *GetDataSwapped(int Index) = 0;
 	virtual void UnloadData(int Index) = 0;
+	// pinned data isn't evicted when the memory budget is exceeded
+	virtual void PinData(int Index) = 0;
+	virtual void UnpinData(int Index) = 0;
+	// changes with every load, the pins of an earlier load are gone
+	virtual unsigned Serial() = 0;
 	virtual void *GetItem(int Index, int *Type, int *pID) = 0;
+	virtual int GetItemSize(int Index) = 0;
 	virtual void GetType(int Type, int *pStart, int *pNum) = 0;
 	virtual void *FindItem(int Type, int ID) = 0;
 	virtual int NumItems() = 0;
@@ -24,11 +30,34 @@ class IEngineMap : public IMap
 {
 	MACRO_INTERFACE("enginemap", 0)
 public:
+	// stages of an asynchronous load
+	enum
+	{
+		LOAD_PENDING=0,
+		LOAD_HEADER,
+		LOAD_ITEMS,
+		LOAD_HASHING,
+		LOAD_PREFETCH,
+		LOAD_DONE,
+		LOAD_FAILED,
+		LOAD_CANCELLED,
+	};
+
 	virtual bool Load(const char *pMapName, class IStorage *pStorage=0) = 0;
+	// loads the map on the job pool, the map must not be used until LoadStatus returns LOAD_DONE
+	virtual void LoadAsync(const char *pMapName, class CJobPool *pJobPool, class IStorage *pStorage) = 0;
+	virtual int LoadStatus() = 0;
+	virtual float LoadProgress() = 0; // of the current stage
+	virtual void CancelLoad() = 0;
 	virtual bool IsLoaded() = 0;
 	virtual void Unload() = 0;
 	virtual SHA256_DIGEST Sha256() = 0;
 	virtual unsigned Crc() = 0;
+
+	// decompresses all data on the job pool in the background
+	virtual void Prefetch(class CJobPool *pJobPool) = 0;
+	// limits the memory of loaded data, 0 disables the limit
+	virtual void SetMemoryBudget(int64 Budget) = 0;
 };
 
 extern IEngineMap *CreateEngineMap();
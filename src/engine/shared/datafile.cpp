@@ -5,9 +5,12 @@
 #include <base/hash_ctxt.h>
 #include <base/math.h>
 #include <base/system.h>
+#include <base/tl/threading.h>
 #include <engine/storage.h>
 #include <zlib.h>
 
+#include "jobs.h"
+
 static const int DEBUG=0;
 
 struct CDatafileItemType
@@ -52,14 +55,69 @@ struct CDatafileInfo
 	int *m_pItemOffsets;
 	int *m_pDataOffsets;
 	int *m_pDataSizes;
+	int *m_pDataCodecs; // v5 only
+	int *m_pEncodedSizes; // v5 only
 
 	char *m_pItemStart;
 	char *m_pDataStart;
 };
 
+struct CDatafilePrefetch
+{
+	CJob m_Job;
+	CDataFileReader *m_pReader;
+	int m_Index;
+	volatile unsigned m_Scheduled;
+	char *m_pData;
+	int m_Size;
+};
+
+struct CDatafileCompressJob
+{
+	CJob m_Job;
+	volatile unsigned m_Claimed;
+	void *m_pInfo;
+};
+
+struct CDatafileOpenJob
+{
+	CJob m_Job;
+	CDataFileReader *m_pReader;
+	IStorage *m_pStorage;
+	char m_aFilename[IO_MAX_PATH_LENGTH];
+	int m_StorageType;
+	int m_Flags;
+	volatile int m_Status;
+	volatile int m_Done;
+	volatile int m_Total;
+	volatile bool m_Cancel;
+};
+
+// reports the stage of an asynchronous open, returns false if it got cancelled
+static bool ReportOpenStage(CDatafileOpenJob *pJob, int Status, int Total)
+{
+	if(!pJob)
+		return true;
+	pJob->m_Done = 0;
+	pJob->m_Total = Total;
+	pJob->m_Status = Status;
+	return !pJob->m_Cancel;
+}
+
+static bool ReportOpenProgress(CDatafileOpenJob *pJob, int Done)
+{
+	if(!pJob)
+		return true;
+	pJob->m_Done = Done;
+	return !pJob->m_Cancel;
+}
+
 struct CDatafile
 {
 	IOHANDLE m_File;
+	char *m_pMap;
+	unsigned m_MapSize;
+	int m_MapType;
 	SHA256_DIGEST m_Sha256;
 	unsigned m_Crc;
 	CDatafileInfo m_Info;
@@ -68,9 +126,320 @@ struct CDatafile
 	char **m_ppDataPtrs;
 	int *m_pDataSizes;
 	char *m_pData;
+	LOCK m_Lock;
+	CDatafilePrefetch *m_pPrefetch;
+	bool *m_pReplaced; // allocated by the first ReplaceData
+	bool m_HashesDone;
+
+	// memory held by loaded blocks, replaced and mapped blocks are not counted. A budget of 0 never evicts
+	int64 m_MemoryBudget;
+	int64 m_MemoryUsed;
+	volatile unsigned m_UseClock;
+	volatile unsigned m_BudgetReaders; // GetData calls running with a budget, there must only be one
+	unsigned m_Serial;
+	unsigned *m_pLastUse;
+	int *m_pPinCount;
+	int *m_pChargedSizes; // what each block adds to m_MemoryUsed
+
+	// lookup tables for the item types and (type, id) pairs, -1 marks free slots
+	int *m_pTypeIndex;
+	unsigned m_TypeIndexMask;
+	int *m_pItemIndex;
+	unsigned m_ItemIndexMask;
+};
+
+enum
+{
+	MAPTYPE_FILE=0, // io_map
+	MAPTYPE_BUFFER, // memory of the caller
+	MAPTYPE_COPY, // own copy of the memory of the caller
 };
 
-bool CDataFileReader::Open(class IStorage *pStorage, const char *pFilename, int StorageType)
+static void ReleaseMap(IOHANDLE File, char *pMap, unsigned MapSize, int MapType)
+{
+	if(MapType == MAPTYPE_FILE)
+		io_unmap(pMap, MapSize);
+	else if(MapType == MAPTYPE_COPY)
+		mem_free(pMap);
+	if(File)
+		io_close(File);
+}
+
+static volatile unsigned s_DatafileSerial = 0;
+
+static bool IsMappedData(const CDatafile *pDataFile, const void *pData)
+{
+	return pDataFile->m_pMap && (const char *)pData >= pDataFile->m_pMap && (const char *)pData < pDataFile->m_pMap+pDataFile->m_MapSize;
+}
+
+static unsigned IndexHash(unsigned Key)
+{
+	Key ^= Key>>16;
+	Key *= 0x45d9f3b;
+	Key ^= Key>>16;
+	return Key;
+}
+
+static unsigned IndexSize(int Num)
+{
+	// keep the tables at most half full
+	unsigned Size = 1;
+	while(Size < (unsigned)Num*2)
+		Size <<= 1;
+	return Size;
+}
+
+static const CDatafileItem *DatafileItem(const CDatafile *pDataFile, int Index)
+{
+	return (const CDatafileItem *)(pDataFile->m_Info.m_pItemStart+pDataFile->m_Info.m_pItemOffsets[Index]);
+}
+
+// returns the position of the type in the item type list or -1
+static int FindTypeEntry(const CDatafile *pDataFile, int Type)
+{
+	for(unsigned Slot = IndexHash(Type)&pDataFile->m_TypeIndexMask;; Slot = (Slot+1)&pDataFile->m_TypeIndexMask)
+	{
+		int Entry = pDataFile->m_pTypeIndex[Slot];
+		if(Entry == -1 || pDataFile->m_Info.m_pItemTypes[Entry].m_Type == Type)
+			return Entry;
+	}
+}
+
+// every item header has to be within the item data
+static bool CheckItemOffsets(const CDatafile *pDataFile)
+{
+	for(int i = 0; i < pDataFile->m_Header.m_NumItems; i++)
+	{
+		int Offset = pDataFile->m_Info.m_pItemOffsets[i];
+		if(Offset < 0 || Offset > pDataFile->m_Header.m_ItemSize-(int)sizeof(CDatafileItem))
+			return false;
+	}
+	return true;
+}
+
+static void BuildItemIndex(CDatafile *pDataFile)
+{
+	int NumTypes = pDataFile->m_Header.m_NumItemTypes;
+	int NumItems = pDataFile->m_Header.m_NumItems;
+	unsigned TypeIndexSize = IndexSize(NumTypes);
+	unsigned ItemIndexSize = IndexSize(NumItems);
+	pDataFile->m_pTypeIndex = (int *)mem_alloc((TypeIndexSize+ItemIndexSize)*sizeof(int));
+	pDataFile->m_TypeIndexMask = TypeIndexSize-1;
+	pDataFile->m_pItemIndex = pDataFile->m_pTypeIndex+TypeIndexSize;
+	pDataFile->m_ItemIndexMask = ItemIndexSize-1;
+	for(unsigned i = 0; i < TypeIndexSize+ItemIndexSize; i++)
+		pDataFile->m_pTypeIndex[i] = -1;
+
+	for(int t = 0; t < NumTypes; t++)
+	{
+		// the first entry of a type wins, like the linear search did
+		const CDatafileItemType *pType = &pDataFile->m_Info.m_pItemTypes[t];
+		unsigned Slot = IndexHash(pType->m_Type)&pDataFile->m_TypeIndexMask;
+		while(pDataFile->m_pTypeIndex[Slot] != -1 && pDataFile->m_Info.m_pItemTypes[pDataFile->m_pTypeIndex[Slot]].m_Type != pType->m_Type)
+			Slot = (Slot+1)&pDataFile->m_TypeIndexMask;
+		if(pDataFile->m_pTypeIndex[Slot] != -1)
+			continue;
+		pDataFile->m_pTypeIndex[Slot] = t;
+
+		// index the items of the type by their id, the first item with an id wins
+		int Start = clamp(pType->m_Start, 0, NumItems);
+		int End = clamp(pType->m_Start+pType->m_Num, Start, NumItems);
+		for(int i = Start; i < End; i++)
+		{
+			int ID = DatafileItem(pDataFile, i)->m_TypeAndID&0xffff;
+			for(Slot = IndexHash((t<<16)|ID)&pDataFile->m_ItemIndexMask;; Slot = (Slot+1)&pDataFile->m_ItemIndexMask)
+			{
+				int Item = pDataFile->m_pItemIndex[Slot];
+				if(Item == -1)
+				{
+					pDataFile->m_pItemIndex[Slot] = i;
+					break;
+				}
+				if(Item >= Start && Item < End && (DatafileItem(pDataFile, Item)->m_TypeAndID&0xffff) == ID)
+					break;
+			}
+		}
+	}
+}
+
+static void HashData(SHA256_CTX *pSha256Ctx, unsigned *pCrc, const void *pData, unsigned Size)
+{
+	sha256_update(pSha256Ctx, pData, Size);
+	*pCrc = crc32(*pCrc, (const Bytef *)pData, Size); // ignore_convention
+}
+
+enum
+{
+	HASH_BUFFER_SIZE = 64*1024,
+	INFLATE_BUFFER_SIZE = 16*1024,
+};
+
+// the tile codec stores the number of runs, the run lengths and then one byte plane per kept tile field
+enum
+{
+	TILE_SIZE=4,
+	TILE_SKIP=2,
+};
+
+static int TileEncodeBound(int Size)
+{
+	// every run costs at most the bytes of its tiles, plus the run count
+	return Size+5;
+}
+
+static int VarintSize(unsigned Value)
+{
+	int Size = 1;
+	for(; Value >= 0x80; Value >>= 7)
+		Size++;
+	return Size;
+}
+
+static unsigned char *WriteVarint(unsigned char *pDst, unsigned Value)
+{
+	for(; Value >= 0x80; Value >>= 7)
+		*pDst++ = (Value&0x7f)|0x80;
+	*pDst++ = Value;
+	return pDst;
+}
+
+static bool ReadVarint(const unsigned char *pSrc, int Size, int *pPos, unsigned *pValue)
+{
+	unsigned Value = 0;
+	for(int Shift = 0; Shift < 32 && *pPos < Size; Shift += 7)
+	{
+		unsigned char Byte = pSrc[(*pPos)++];
+		Value |= (Byte&0x7f)<<Shift;
+		if(!(Byte&0x80))
+		{
+			*pValue = Value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool SameTile(const unsigned char *pA, const unsigned char *pB)
+{
+	return pA[0] == pB[0] && pA[1] == pB[1] && pA[3] == pB[3];
+}
+
+static int EncodeTiles(const unsigned char *pSrc, int Size, unsigned char *pDst)
+{
+	const int NumTiles = Size/TILE_SIZE;
+
+	// count the runs to place the planes behind the lengths
+	int NumRuns = 0;
+	int LengthsSize = 0;
+	for(int i = 0; i < NumTiles;)
+	{
+		int Run = 1;
+		while(i+Run < NumTiles && SameTile(pSrc+i*TILE_SIZE, pSrc+(i+Run)*TILE_SIZE))
+			Run++;
+		LengthsSize += VarintSize(Run);
+		NumRuns++;
+		i += Run;
+	}
+
+	unsigned char *pLength = WriteVarint(pDst, NumRuns);
+	unsigned char *pIndex = pLength+LengthsSize;
+	unsigned char *pFlags = pIndex+NumRuns;
+	unsigned char *pReserved = pFlags+NumRuns;
+	for(int i = 0; i < NumTiles;)
+	{
+		const unsigned char *pTile = pSrc+i*TILE_SIZE;
+		int Run = 1;
+		while(i+Run < NumTiles && SameTile(pTile, pSrc+(i+Run)*TILE_SIZE))
+			Run++;
+		pLength = WriteVarint(pLength, Run);
+		*pIndex++ = pTile[0];
+		*pFlags++ = pTile[1];
+		*pReserved++ = pTile[3];
+		i += Run;
+	}
+	return pReserved-pDst;
+}
+
+static bool DecodeTiles(const unsigned char *pSrc, int SrcSize, unsigned char *pDst, int DstSize)
+{
+	if(DstSize%TILE_SIZE)
+		return false;
+	const unsigned NumTiles = DstSize/TILE_SIZE;
+
+	// validate the runs before writing anything
+	int Pos = 0;
+	unsigned NumRuns;
+	if(!ReadVarint(pSrc, SrcSize, &Pos, &NumRuns) || NumRuns > NumTiles)
+		return false;
+	const int LengthsStart = Pos;
+	unsigned Total = 0;
+	for(unsigned r = 0; r < NumRuns; r++)
+	{
+		unsigned Run;
+		if(!ReadVarint(pSrc, SrcSize, &Pos, &Run) || Run == 0 || Run > NumTiles-Total)
+			return false;
+		Total += Run;
+	}
+	if(Total != NumTiles || (int64)Pos+NumRuns*3 != SrcSize)
+		return false;
+
+	const unsigned char *pIndex = pSrc+Pos;
+	const unsigned char *pFlags = pIndex+NumRuns;
+	const unsigned char *pReserved = pFlags+NumRuns;
+	Pos = LengthsStart;
+	for(unsigned r = 0; r < NumRuns; r++)
+	{
+		unsigned Run = 0;
+		ReadVarint(pSrc, SrcSize, &Pos, &Run);
+		for(unsigned char *pEnd = pDst+Run*TILE_SIZE; pDst < pEnd; pDst += TILE_SIZE)
+		{
+			pDst[0] = pIndex[r];
+			pDst[1] = pFlags[r];
+			pDst[TILE_SKIP] = 0;
+			pDst[3] = pReserved[r];
+		}
+	}
+	return true;
+}
+
+// hashes everything from the current file position to the end
+static bool HashRemaining(IOHANDLE File, SHA256_CTX *pSha256Ctx, unsigned *pCrc, CDatafileOpenJob *pJob)
+{
+	unsigned char aBuffer[HASH_BUFFER_SIZE];
+	unsigned Offset = 0;
+
+	while(1)
+	{
+		unsigned Bytes = io_read(File, aBuffer, HASH_BUFFER_SIZE);
+		if(Bytes == 0)
+			break;
+		HashData(pSha256Ctx, pCrc, aBuffer, Bytes);
+		Offset += Bytes;
+		if(!ReportOpenProgress(pJob, Offset))
+			return false;
+	}
+	return true;
+}
+
+static bool HashMemory(const char *pData, unsigned Size, SHA256_CTX *pSha256Ctx, unsigned *pCrc, CDatafileOpenJob *pJob)
+{
+	for(unsigned Offset = 0; Offset < Size; Offset += HASH_BUFFER_SIZE)
+	{
+		HashData(pSha256Ctx, pCrc, pData+Offset, minimum(Size-Offset, (unsigned)HASH_BUFFER_SIZE));
+		if(!ReportOpenProgress(pJob, Offset))
+			return false;
+	}
+	return true;
+}
+
+bool CDataFileReader::Open(class IStorage *pStorage, const char *pFilename, int StorageType, int Flags)
+{
+	// a pending open would write into the new file
+	StopOpenJob();
+	return OpenStorage(pStorage, pFilename, StorageType, Flags, 0);
+}
+
+bool CDataFileReader::OpenStorage(class IStorage *pStorage, const char *pFilename, int StorageType, int Flags, CDatafileOpenJob *pJob)
 {
 	dbg_msg("datafile", "loading. filename='%s'", pFilename);
 
@@ -81,40 +450,135 @@ bool CDataFileReader::Open(class IStorage *pStorage, const char *pFilename, int
 		return false;
 	}
 
+	unsigned MapSize = 0;
+	char *pMap = 0;
+	if(Flags&OPENFLAG_MMAP)
+	{
+		pMap = (char *)io_map(File, &MapSize);
+		if(!pMap)
+			dbg_msg("datafile", "could not map '%s', reading it instead", pFilename);
+	}
 
-	// take the hashes of the file and store them
-	SHA256_CTX Sha256Ctx;
-	sha256_init(&Sha256Ctx);
-	unsigned Crc = crc32(0L, 0x0, 0);
+	return OpenImpl(File, pMap, MapSize, MAPTYPE_FILE, Flags, pFilename, pJob);
+}
+
+int CDataFileReader::OpenJob(void *pUser)
+{
+	CDatafileOpenJob *pJob = static_cast<CDatafileOpenJob *>(pUser);
+	bool Result = pJob->m_pReader->OpenStorage(pJob->m_pStorage, pJob->m_aFilename, pJob->m_StorageType, pJob->m_Flags, pJob);
+	sync_barrier();
+	pJob->m_Status = Result ? OPEN_DONE : pJob->m_Cancel ? OPEN_CANCELLED : OPEN_FAILED;
+	return 0;
+}
+
+void CDataFileReader::OpenAsync(CJobPool *pJobPool, class IStorage *pStorage, const char *pFilename, int StorageType, int Flags)
+{
+	Close();
+
+	m_pOpenJob = new CDatafileOpenJob;
+	m_pOpenJob->m_pReader = this;
+	m_pOpenJob->m_pStorage = pStorage;
+	str_copy(m_pOpenJob->m_aFilename, pFilename, sizeof(m_pOpenJob->m_aFilename));
+	m_pOpenJob->m_StorageType = StorageType;
+	m_pOpenJob->m_Flags = Flags;
+	m_pOpenJob->m_Status = OPEN_PENDING;
+	m_pOpenJob->m_Done = 0;
+	m_pOpenJob->m_Total = 0;
+	m_pOpenJob->m_Cancel = false;
+	pJobPool->Add(&m_pOpenJob->m_Job, OpenJob, m_pOpenJob);
+}
+
+int CDataFileReader::OpenStatus() const
+{
+	if(!m_pOpenJob)
+		return m_pDataFile ? OPEN_DONE : OPEN_FAILED;
+	return m_pOpenJob->m_Status;
+}
+
+float CDataFileReader::OpenProgress() const
+{
+	if(!m_pOpenJob)
+		return m_pDataFile ? 1.0f : 0.0f;
+	int Total = m_pOpenJob->m_Total;
+	return Total > 0 ? clamp(m_pOpenJob->m_Done/(float)Total, 0.0f, 1.0f) : 0.0f;
+}
+
+void CDataFileReader::CancelOpen()
+{
+	if(m_pOpenJob)
+		m_pOpenJob->m_Cancel = true;
+}
+
+bool CDataFileReader::WaitOpen()
+{
+	if(m_pOpenJob)
 	{
-		enum
-		{
-			BUFFER_SIZE = 64*1024
-		};
+		while(m_pOpenJob->m_Job.Status() != CJob::STATE_DONE)
+			thread_yield();
+		sync_barrier();
+	}
+	return OpenStatus() == OPEN_DONE;
+}
 
-		unsigned char aBuffer[BUFFER_SIZE];
+bool CDataFileReader::IsOpen() const
+{
+	return m_pDataFile != 0 && (!m_pOpenJob || m_pOpenJob->m_Status == OPEN_DONE);
+}
 
-		while(1)
-		{
-			unsigned Bytes = io_read(File, aBuffer, BUFFER_SIZE);
-			if(Bytes == 0)
-				break;
-			sha256_update(&Sha256Ctx, aBuffer, Bytes);
-			Crc = crc32(Crc, aBuffer, Bytes); // ignore_convention
-		}
+bool CDataFileReader::OpenMemory(void *pData, unsigned Size, int Flags)
+{
+	StopOpenJob();
+	dbg_msg("datafile", "loading from memory. size=%u", Size);
+
+	// the users of the items and data can change the buffer, so it can't be hashed later on
+	Flags &= ~OPENFLAG_LAZY_HASH;
+
+	char *pMap = (char *)pData;
+	int MapType = MAPTYPE_BUFFER;
+#if defined(CONF_ARCH_ENDIAN_BIG)
+	// the types, offsets and items get swapped in place
+	pMap = (char *)mem_alloc(Size);
+	mem_copy(pMap, pData, Size);
+	MapType = MAPTYPE_COPY;
+#endif
+
+	return OpenImpl(0, pMap, Size, MapType, Flags&~OPENFLAG_MMAP, "memory", 0);
+}
+
+bool CDataFileReader::OpenImpl(IOHANDLE File, char *pMap, unsigned MapSize, int MapType, int Flags, const char *pName, CDatafileOpenJob *pJob)
+{
+	// take the hashes of the file while reading it, unless they are requested later on
+	const bool LazyHash = Flags&OPENFLAG_LAZY_HASH;
+	const bool StreamHash = !LazyHash && !pMap;
+	SHA256_CTX Sha256Ctx;
+	sha256_init(&Sha256Ctx);
+	unsigned Crc = crc32(0L, 0x0, 0);
 
-		io_seek(File, 0, IOSEEK_START);
+	if(!ReportOpenStage(pJob, OPEN_HEADER, 1))
+	{
+		ReleaseMap(File, pMap, MapSize, MapType);
+		return false;
 	}
 
 	// TODO: change this header
 	CDatafileHeader Header;
-	io_read(File, &Header, sizeof(Header));
+	if(pMap)
+	{
+		mem_zero(&Header, sizeof(Header));
+		mem_copy(&Header, pMap, minimum(MapSize, (unsigned)sizeof(Header)));
+	}
+	else
+	{
+		unsigned HeaderSize = io_read(File, &Header, sizeof(Header));
+		if(StreamHash)
+			HashData(&Sha256Ctx, &Crc, &Header, HeaderSize);
+	}
 	if(Header.m_aID[0] != 'A' || Header.m_aID[1] != 'T' || Header.m_aID[2] != 'A' || Header.m_aID[3] != 'D')
 	{
 		if(Header.m_aID[0] != 'D' || Header.m_aID[1] != 'A' || Header.m_aID[2] != 'T' || Header.m_aID[3] != 'A')
 		{
 			dbg_msg("datafile", "wrong signature. %x %x %x %x", Header.m_aID[0], Header.m_aID[1], Header.m_aID[2], Header.m_aID[3]);
-			io_close(File);
+			ReleaseMap(File, pMap, MapSize, MapType);
 			return 0;
 		}
 	}
@@ -122,10 +586,10 @@ bool CDataFileReader::Open(class IStorage *pStorage, const char *pFilename, int
 #if defined(CONF_ARCH_ENDIAN_BIG)
 	swap_endian(&Header, sizeof(int), sizeof(Header)/sizeof(int));
 #endif
-	if(Header.m_Version != 3 && Header.m_Version != 4)
+	if(Header.m_Version < 3 || Header.m_Version > 5)
 	{
 		dbg_msg("datafile", "wrong version. version=%x", Header.m_Version);
-		io_close(File);
+		ReleaseMap(File, pMap, MapSize, MapType);
 		return 0;
 	}
 
@@ -133,17 +597,21 @@ bool CDataFileReader::Open(class IStorage *pStorage, const char *pFilename, int
 	int64 Size = 0;
 	Size += Header.m_NumItemTypes*sizeof(CDatafileItemType);
 	Size += (Header.m_NumItems+Header.m_NumRawData)*sizeof(int);
-	if(Header.m_Version == 4)
+	if(Header.m_Version >= 4)
 		Size += Header.m_NumRawData*sizeof(int); // v4 has uncompressed data sizes aswell
+	if(Header.m_Version >= 5)
+		Size += Header.m_NumRawData*2*sizeof(int); // v5 has the codecs and the encoded sizes
 	Size += Header.m_ItemSize;
 
-	int64 AllocSize = Size;
+	int64 AllocSize = pMap ? 0 : Size; // the mapping already holds the types, offsets, sizes and item data
 	AllocSize += sizeof(CDatafile); // add space for info structure
 	AllocSize += Header.m_NumRawData*sizeof(void*); // add space for data pointers
 	AllocSize += Header.m_NumRawData*sizeof(int); // add space for data sizes
-	if(Size > (int64(1)<<31) || Header.m_NumItemTypes < 0 || Header.m_NumItems < 0 || Header.m_NumRawData < 0 || Header.m_ItemSize < 0)
+	AllocSize += Header.m_NumRawData*(sizeof(unsigned)+2*sizeof(int)); // add space for last use stamps, pin counts and charged sizes
+	if(Size > (int64(1)<<31) || Header.m_NumItemTypes < 0 || Header.m_NumItems < 0 || Header.m_NumRawData < 0 || Header.m_ItemSize < 0 ||
+		(pMap && (int64)sizeof(CDatafileHeader)+Size > MapSize))
 	{
-		io_close(File);
+		ReleaseMap(File, pMap, MapSize, MapType);
 		dbg_msg("datafile", "unable to load file, invalid file information");
 		return false;
 	}
@@ -153,28 +621,86 @@ bool CDataFileReader::Open(class IStorage *pStorage, const char *pFilename, int
 	pTmpDataFile->m_DataStartOffset = sizeof(CDatafileHeader) + Size;
 	pTmpDataFile->m_ppDataPtrs = (char **)(pTmpDataFile+1);
 	pTmpDataFile->m_pDataSizes = (int *)(pTmpDataFile->m_ppDataPtrs + Header.m_NumRawData);
-	pTmpDataFile->m_pData = (char *)(pTmpDataFile->m_pDataSizes + Header.m_NumRawData);
+	pTmpDataFile->m_pLastUse = (unsigned *)(pTmpDataFile->m_pDataSizes + Header.m_NumRawData);
+	pTmpDataFile->m_pPinCount = (int *)(pTmpDataFile->m_pLastUse + Header.m_NumRawData);
+	pTmpDataFile->m_pChargedSizes = pTmpDataFile->m_pPinCount + Header.m_NumRawData;
+	pTmpDataFile->m_pData = pMap ? pMap+sizeof(CDatafileHeader) : (char *)(pTmpDataFile->m_pChargedSizes + Header.m_NumRawData);
 	pTmpDataFile->m_File = File;
-	pTmpDataFile->m_Sha256 = sha256_finish(&Sha256Ctx);
-	pTmpDataFile->m_Crc = Crc;
-
-	// clear the data pointers and sizes
+	pTmpDataFile->m_pMap = pMap;
+	pTmpDataFile->m_MapSize = MapSize;
+	pTmpDataFile->m_MapType = MapType;
+	pTmpDataFile->m_pPrefetch = 0;
+	pTmpDataFile->m_pReplaced = 0;
+	pTmpDataFile->m_pTypeIndex = 0;
+	pTmpDataFile->m_HashesDone = !LazyHash;
+	pTmpDataFile->m_MemoryBudget = m_MemoryBudget;
+	pTmpDataFile->m_MemoryUsed = 0;
+	pTmpDataFile->m_UseClock = 0;
+	pTmpDataFile->m_BudgetReaders = 0;
+	pTmpDataFile->m_Serial = atomic_inc(&s_DatafileSerial);
+
+	// clear the data pointers, sizes and cache information
 	mem_zero(pTmpDataFile->m_ppDataPtrs, Header.m_NumRawData*sizeof(void*));
 	mem_zero(pTmpDataFile->m_pDataSizes, Header.m_NumRawData*sizeof(int));
+	mem_zero(pTmpDataFile->m_pLastUse, Header.m_NumRawData*(sizeof(unsigned)+2*sizeof(int)));
 
 	// read types, offsets, sizes and item data
-	unsigned ReadSize = io_read(File, pTmpDataFile->m_pData, Size);
-	if(ReadSize != Size)
+	unsigned ReadSize = Size;
+	bool Cancelled = !ReportOpenStage(pJob, OPEN_ITEMS, 1);
+	if(Cancelled)
 	{
-		io_close(pTmpDataFile->m_File);
+		ReleaseMap(File, pMap, MapSize, MapType);
 		mem_free(pTmpDataFile);
-		pTmpDataFile = 0;
-		dbg_msg("datafile", "couldn't load the whole thing, wanted=%d got=%d", unsigned(Size), ReadSize);
 		return false;
 	}
+	if(pMap)
+	{
+		// everything is served from the mapping, the file is only needed for hashing the unmodified contents
+		if(!LazyHash && File)
+		{
+			io_close(File);
+			pTmpDataFile->m_File = 0;
+		}
+		if(!LazyHash)
+			Cancelled = !ReportOpenStage(pJob, OPEN_HASHING, MapSize) || !HashMemory(pMap, MapSize, &Sha256Ctx, &Crc, pJob);
+	}
+	else
+	{
+		ReadSize = io_read(File, pTmpDataFile->m_pData, Size);
+		if(ReadSize != Size)
+		{
+			io_close(pTmpDataFile->m_File);
+			mem_free(pTmpDataFile);
+			pTmpDataFile = 0;
+			dbg_msg("datafile", "couldn't load the whole thing, wanted=%d got=%d", unsigned(Size), ReadSize);
+			return false;
+		}
 
-	Close();
+		// hash the data blocks by streaming through the rest of the file
+		if(StreamHash)
+		{
+			HashData(&Sha256Ctx, &Crc, pTmpDataFile->m_pData, ReadSize);
+			Cancelled = !ReportOpenStage(pJob, OPEN_HASHING, Header.m_DataSize) || !HashRemaining(File, &Sha256Ctx, &Crc, pJob);
+		}
+	}
+
+	if(Cancelled)
+	{
+		ReleaseMap(pTmpDataFile->m_File, pMap, MapSize, MapType);
+		mem_free(pTmpDataFile);
+		return false;
+	}
+
+	if(!LazyHash)
+	{
+		pTmpDataFile->m_Sha256 = sha256_finish(&Sha256Ctx);
+		pTmpDataFile->m_Crc = Crc;
+	}
+
+	if(!pJob)
+		CloseFile();
 	m_pDataFile = pTmpDataFile;
+	m_pDataFile->m_Lock = lock_create();
 
 #if defined(CONF_ARCH_ENDIAN_BIG)
 	swap_endian(m_pDataFile->m_pData, sizeof(int), minimum(static_cast<unsigned>(Header.m_Swaplen), static_cast<unsigned>(Size)) / sizeof(int));
@@ -193,13 +719,44 @@ bool CDataFileReader::Open(class IStorage *pStorage, const char *pFilename, int
 	m_pDataFile->m_Info.m_pDataOffsets = (int *)&m_pDataFile->m_Info.m_pItemOffsets[m_pDataFile->m_Header.m_NumItems];
 	m_pDataFile->m_Info.m_pDataSizes = (int *)&m_pDataFile->m_Info.m_pDataOffsets[m_pDataFile->m_Header.m_NumRawData];
 
-	if(Header.m_Version == 4)
+	m_pDataFile->m_Info.m_pDataCodecs = 0;
+	m_pDataFile->m_Info.m_pEncodedSizes = 0;
+	if(Header.m_Version == 5)
+	{
+		m_pDataFile->m_Info.m_pDataCodecs = &m_pDataFile->m_Info.m_pDataSizes[m_pDataFile->m_Header.m_NumRawData];
+		m_pDataFile->m_Info.m_pEncodedSizes = &m_pDataFile->m_Info.m_pDataCodecs[m_pDataFile->m_Header.m_NumRawData];
+		m_pDataFile->m_Info.m_pItemStart = (char *)&m_pDataFile->m_Info.m_pEncodedSizes[m_pDataFile->m_Header.m_NumRawData];
+	}
+	else if(Header.m_Version == 4)
 		m_pDataFile->m_Info.m_pItemStart = (char *)&m_pDataFile->m_Info.m_pDataSizes[m_pDataFile->m_Header.m_NumRawData];
 	else
 		m_pDataFile->m_Info.m_pItemStart = (char *)&m_pDataFile->m_Info.m_pDataOffsets[m_pDataFile->m_Header.m_NumRawData];
 	m_pDataFile->m_Info.m_pDataStart = m_pDataFile->m_Info.m_pItemStart + m_pDataFile->m_Header.m_ItemSize;
 
-	dbg_msg("datafile", "loading done. datafile='%s'", pFilename);
+	if(!CheckItemOffsets(m_pDataFile))
+	{
+		dbg_msg("datafile", "invalid item offsets. datafile='%s'", pName);
+		CloseFile();
+		return false;
+	}
+	BuildItemIndex(m_pDataFile);
+
+	// load all the blocks right away
+	if(Flags&OPENFLAG_PREFETCH)
+	{
+		ReportOpenStage(pJob, OPEN_PREFETCH, m_pDataFile->m_Header.m_NumRawData);
+		for(int i = 0; i < m_pDataFile->m_Header.m_NumRawData; i++)
+		{
+			if(!ReportOpenProgress(pJob, i))
+			{
+				CloseFile();
+				return false;
+			}
+			GetDataImpl(i, 0);
+		}
+	}
+
+	dbg_msg("datafile", "loading done. datafile='%s'", pName);
 
 	if(DEBUG)
 	{
@@ -273,67 +830,356 @@ int CDataFileReader::GetDataSize(int Index) const
 			return GetFileDataSize(Index);
 		}
 	}
-	return m_pDataFile->m_pDataSizes[Index];
+	return m_pDataFile->m_pDataSizes[Index];
+}
+
+bool CDataFileReader::ReadFileData(int Index, void *pBuffer, int Size)
+{
+	return io_read_at(m_pDataFile->m_File, pBuffer, Size, m_pDataFile->m_DataStartOffset+m_pDataFile->m_Info.m_pDataOffsets[Index]) == (unsigned)Size;
+}
+
+char *CDataFileReader::LoadData(int Index, int *pSize)
+{
+	*pSize = 0;
+
+	// fetch the data size
+	int DataSize = GetFileDataSize(Index);
+
+	// locate the data inside the mapping
+	char *pMapped = 0;
+	if(m_pDataFile->m_pMap)
+	{
+		int64 Offset = (int64)m_pDataFile->m_DataStartOffset+m_pDataFile->m_Info.m_pDataOffsets[Index];
+		if(DataSize < 0 || Offset < 0 || Offset+DataSize > m_pDataFile->m_MapSize)
+		{
+			dbg_msg("datafile", "data index=%d exceeds the file", Index);
+			return 0;
+		}
+		pMapped = m_pDataFile->m_pMap+Offset;
+	}
+
+	char *pData;
+	if(m_pDataFile->m_Header.m_Version >= 4)
+	{
+		// v4 has compressed data
+		int UncompressedSize = m_pDataFile->m_Info.m_pDataSizes[Index];
+		int Codec = GetDataCodec(Index);
+		int EncodedSize = Codec == DATACODEC_NONE ? UncompressedSize : m_pDataFile->m_Info.m_pEncodedSizes[Index];
+		if(UncompressedSize < 0 || DataSize < 0 || EncodedSize < 0 || (Codec != DATACODEC_NONE && Codec != DATACODEC_TILES))
+		{
+			dbg_msg("datafile", "invalid data size index=%d size=%d uncompressed=%d codec=%d", Index, DataSize, UncompressedSize, Codec);
+			return 0;
+		}
+
+		dbg_msg("datafile", "loading data index=%d size=%d uncompressed=%d", Index, DataSize, UncompressedSize);
+		pData = (char *)mem_alloc(UncompressedSize);
+		if(Codec == DATACODEC_NONE)
+		{
+			if(!InflateData(Index, pMapped, DataSize, pData, UncompressedSize))
+			{
+				mem_free(pData);
+				return 0;
+			}
+		}
+		else
+		{
+			// undo the transform after inflating it
+			char *pEncoded = (char *)mem_alloc(EncodedSize);
+			bool Decoded = InflateData(Index, pMapped, DataSize, pEncoded, EncodedSize) &&
+				DecodeTiles((const unsigned char *)pEncoded, EncodedSize, (unsigned char *)pData, UncompressedSize);
+			mem_free(pEncoded);
+			if(!Decoded)
+			{
+				dbg_msg("datafile", "failed to decode data index=%d codec=%d", Index, Codec);
+				mem_free(pData);
+				return 0;
+			}
+		}
+		*pSize = UncompressedSize;
+	}
+#if !defined(CONF_ARCH_ENDIAN_BIG)
+	else if(pMapped && ((uintptr_t)pMapped&(sizeof(int)-1)) == 0)
+	{
+		// use the mapped data in place, big endian copies it instead as it's swapped before being published
+		dbg_msg("datafile", "mapping data index=%d size=%d", Index, DataSize);
+		pData = pMapped;
+		*pSize = DataSize;
+	}
+#endif
+	else
+	{
+		// load the data
+		dbg_msg("datafile", "loading data index=%d size=%d", Index, DataSize);
+		if(DataSize < 0)
+			return 0;
+		pData = (char *)mem_alloc(DataSize);
+		if(pMapped)
+			mem_copy(pData, pMapped, DataSize);
+		else if(!ReadFileData(Index, pData, DataSize))
+		{
+			dbg_msg("datafile", "failed to read data index=%d size=%d", Index, DataSize);
+			mem_free(pData);
+			return 0;
+		}
+		*pSize = DataSize;
+	}
+
+	return pData;
+}
+
+bool CDataFileReader::InflateData(int Index, const char *pMapped, int DataSize, char *pData, int Size)
+{
+	// inflate straight into the destination, either from the mapping or through a small read buffer
+	unsigned char aBuffer[INFLATE_BUFFER_SIZE];
+	char Dummy;
+	z_stream Stream;
+	mem_zero(&Stream, sizeof(Stream));
+	Stream.next_out = (Bytef *)(Size ? pData : &Dummy);
+	Stream.avail_out = Size;
+	int Result = inflateInit(&Stream);
+	if(Result == Z_OK)
+	{
+		if(pMapped)
+		{
+			Stream.next_in = (Bytef *)pMapped;
+			Stream.avail_in = DataSize;
+			Result = inflate(&Stream, Z_FINISH);
+		}
+		else
+		{
+			unsigned Offset = m_pDataFile->m_DataStartOffset+m_pDataFile->m_Info.m_pDataOffsets[Index];
+			int Left = DataSize;
+			while(Result == Z_OK && Left > 0)
+			{
+				unsigned Bytes = io_read_at(m_pDataFile->m_File, aBuffer, minimum(Left, (int)INFLATE_BUFFER_SIZE), Offset);
+				if(Bytes == 0)
+					break;
+				Offset += Bytes;
+				Left -= Bytes;
+				Stream.next_in = aBuffer;
+				Stream.avail_in = Bytes;
+				Result = inflate(&Stream, Left > 0 ? Z_NO_FLUSH : Z_FINISH);
+			}
+		}
+		inflateEnd(&Stream);
+	}
+
+	if(Result != Z_STREAM_END || Stream.total_out != (uLong)Size)
+	{
+		dbg_msg("datafile", "failed to decompress data index=%d result=%d (%s) size=%lu expected=%d", Index, Result, Stream.msg ? Stream.msg : "", Stream.total_out, Size);
+		return false;
+	}
+	return true;
+}
+
+int CDataFileReader::PrefetchJob(void *pUser)
+{
+	CDatafilePrefetch *pPrefetch = static_cast<CDatafilePrefetch *>(pUser);
+	pPrefetch->m_pData = pPrefetch->m_pReader->LoadData(pPrefetch->m_Index, &pPrefetch->m_Size);
+	return 0;
+}
+
+void CDataFileReader::Prefetch(CJobPool *pJobPool, const int *pIndices, int NumIndices)
+{
+	if(!m_pDataFile)
+		return;
+
+	int NumData = m_pDataFile->m_Header.m_NumRawData;
+	if(!m_pDataFile->m_pPrefetch)
+	{
+		m_pDataFile->m_pPrefetch = new CDatafilePrefetch[NumData];
+		for(int i = 0; i < NumData; i++)
+		{
+			m_pDataFile->m_pPrefetch[i].m_pReader = this;
+			m_pDataFile->m_pPrefetch[i].m_Index = i;
+			m_pDataFile->m_pPrefetch[i].m_Scheduled = false;
+		}
+	}
+
+	if(!pIndices)
+		NumIndices = NumData;
+	for(int i = 0; i < NumIndices; i++)
+	{
+		int Index = pIndices ? pIndices[i] : i;
+		if(Index < 0 || Index >= NumData || m_pDataFile->m_ppDataPtrs[Index] || m_pDataFile->m_pPrefetch[Index].m_Scheduled)
+			continue;
+
+		CDatafilePrefetch *pPrefetch = &m_pDataFile->m_pPrefetch[Index];
+		pPrefetch->m_pData = 0;
+		pPrefetch->m_Size = 0;
+		pJobPool->Add(&pPrefetch->m_Job, PrefetchJob, pPrefetch);
+		pPrefetch->m_Scheduled = true;
+	}
+}
+
+void CDataFileReader::WaitPrefetch(int Index)
+{
+	CDatafilePrefetch *pPrefetch = &m_pDataFile->m_pPrefetch[Index];
+	while(pPrefetch->m_Job.Status() != CJob::STATE_DONE)
+		thread_yield();
+	sync_barrier();
+}
+
+void CDataFileReader::WaitPrefetch()
+{
+	if(!m_pDataFile || !m_pDataFile->m_pPrefetch)
+		return;
+
+	for(int i = 0; i < m_pDataFile->m_Header.m_NumRawData; i++)
+	{
+		if(m_pDataFile->m_pPrefetch[i].m_Scheduled)
+			WaitPrefetch(i);
+	}
+}
+
+char *CDataFileReader::TakePrefetched(int Index, int *pSize)
+{
+	*pSize = 0;
+	if(!m_pDataFile->m_pPrefetch)
+		return 0;
+
+	// only one caller gets the prefetched block
+	CDatafilePrefetch *pPrefetch = &m_pDataFile->m_pPrefetch[Index];
+	if(!pPrefetch->m_Scheduled || atomic_compswap(&pPrefetch->m_Scheduled, 1, 0) != 1)
+		return 0;
+	WaitPrefetch(Index);
+	*pSize = pPrefetch->m_Size;
+	return pPrefetch->m_pData;
+}
+
+void *CDataFileReader::GetDataImpl(int Index, int Swap)
+{
+	if(!m_pDataFile) { return 0; }
+
+	if(Index < 0 || Index >= m_pDataFile->m_Header.m_NumRawData)
+		return 0;
+
+	if(!m_pDataFile->m_MemoryBudget)
+		return GetPublishedData(Index, Swap);
+
+	// loading a block can evict the ones other threads just got
+	dbg_assert(atomic_inc(&m_pDataFile->m_BudgetReaders) == 1, "datafile with a memory budget used by several threads");
+	void *pData = GetPublishedData(Index, Swap);
+	atomic_dec(&m_pDataFile->m_BudgetReaders);
+	return pData;
+}
+
+void *CDataFileReader::GetPublishedData(int Index, int Swap)
+{
+	// load it if needed
+	char * volatile *ppPublished = &m_pDataFile->m_ppDataPtrs[Index];
+	char *pPublished = *ppPublished;
+	if(!pPublished)
+	{
+		int Size;
+		char *pData = TakePrefetched(Index, &Size);
+		if(!pData)
+			pData = LoadData(Index, &Size);
+		if(!pData)
+			return 0;
+
+#if defined(CONF_ARCH_ENDIAN_BIG)
+		if(Swap && Size)
+			swap_endian(pData, sizeof(int), Size/sizeof(int));
+#endif
+
+		// publish the block, if another thread was faster use its copy instead
+		m_pDataFile->m_pDataSizes[Index] = Size;
+		pPublished = (char *)atomic_compswap_ptr((void * volatile *)ppPublished, 0, pData);
+		if(pPublished)
+		{
+			if(!IsMappedData(m_pDataFile, pData))
+				mem_free(pData);
+		}
+		else
+		{
+			pPublished = pData;
+			if(!IsMappedData(m_pDataFile, pData))
+			{
+				m_pDataFile->m_pLastUse[Index] = atomic_inc(&m_pDataFile->m_UseClock);
+				lock_wait(m_pDataFile->m_Lock);
+				m_pDataFile->m_pChargedSizes[Index] = Size;
+				m_pDataFile->m_MemoryUsed += Size;
+				EvictData(Index);
+				lock_unlock(m_pDataFile->m_Lock);
+				return pPublished;
+			}
+		}
+	}
+
+	if(m_pDataFile->m_MemoryBudget)
+		m_pDataFile->m_pLastUse[Index] = atomic_inc(&m_pDataFile->m_UseClock);
+	return pPublished;
+}
+
+bool CDataFileReader::IsCachedData(int Index) const
+{
+	return m_pDataFile->m_ppDataPtrs[Index] && !IsMappedData(m_pDataFile, m_pDataFile->m_ppDataPtrs[Index]) &&
+		!(m_pDataFile->m_pReplaced && m_pDataFile->m_pReplaced[Index]);
+}
+
+void CDataFileReader::EvictData(int KeepIndex)
+{
+	// drop the least recently used unpinned blocks until the budget fits, they get reloaded on the next access
+	while(m_pDataFile->m_MemoryBudget && m_pDataFile->m_MemoryUsed > m_pDataFile->m_MemoryBudget)
+	{
+		int Oldest = -1;
+		for(int i = 0; i < m_pDataFile->m_Header.m_NumRawData; i++)
+		{
+			if(i != KeepIndex && !m_pDataFile->m_pPinCount[i] && IsCachedData(i) &&
+				(Oldest == -1 || (int)(m_pDataFile->m_pLastUse[i]-m_pDataFile->m_pLastUse[Oldest]) < 0))
+				Oldest = i;
+		}
+		if(Oldest == -1)
+			break;
+
+		m_pDataFile->m_MemoryUsed -= m_pDataFile->m_pChargedSizes[Oldest];
+		m_pDataFile->m_pChargedSizes[Oldest] = 0;
+		mem_free(m_pDataFile->m_ppDataPtrs[Oldest]);
+		m_pDataFile->m_ppDataPtrs[Oldest] = 0x0;
+		m_pDataFile->m_pDataSizes[Oldest] = 0;
+	}
 }
 
-void *CDataFileReader::GetDataImpl(int Index, int Swap)
+void CDataFileReader::SetMemoryBudget(int64 Budget)
 {
-	if(!m_pDataFile) { return 0; }
-
-	if(Index < 0 || Index >= m_pDataFile->m_Header.m_NumRawData)
-		return 0;
-
-	// load it if needed
-	if(!m_pDataFile->m_ppDataPtrs[Index])
-	{
-		// fetch the data size
-		int DataSize = GetFileDataSize(Index);
-#if defined(CONF_ARCH_ENDIAN_BIG)
-		int SwapSize = DataSize;
-#endif
-
-		if(m_pDataFile->m_Header.m_Version == 4)
-		{
-			// v4 has compressed data
-			void *pTemp = (char *)mem_alloc(DataSize);
-			unsigned long UncompressedSize = m_pDataFile->m_Info.m_pDataSizes[Index];
-			unsigned long s;
+	m_MemoryBudget = Budget;
+	if(!m_pDataFile)
+		return;
 
-			dbg_msg("datafile", "loading data index=%d size=%d uncompressed=%lu", Index, DataSize, UncompressedSize);
-			m_pDataFile->m_ppDataPtrs[Index] = (char *)mem_alloc(UncompressedSize);
-			m_pDataFile->m_pDataSizes[Index] = UncompressedSize;
+	lock_wait(m_pDataFile->m_Lock);
+	m_pDataFile->m_MemoryBudget = Budget;
+	EvictData(-1);
+	lock_unlock(m_pDataFile->m_Lock);
+}
 
-			// read the compressed data
-			io_seek(m_pDataFile->m_File, m_pDataFile->m_DataStartOffset+m_pDataFile->m_Info.m_pDataOffsets[Index], IOSEEK_START);
-			io_read(m_pDataFile->m_File, pTemp, DataSize);
+int64 CDataFileReader::MemoryUsage() const
+{
+	if(!m_pDataFile)
+		return 0;
+	return m_pDataFile->m_MemoryUsed;
+}
 
-			// decompress the data, TODO: check for errors
-			s = UncompressedSize;
-			uncompress((Bytef*)m_pDataFile->m_ppDataPtrs[Index], &s, (Bytef*)pTemp, DataSize); // ignore_convention
-#if defined(CONF_ARCH_ENDIAN_BIG)
-			SwapSize = s;
-#endif
+void CDataFileReader::PinData(int Index)
+{
+	if(!m_pDataFile || Index < 0 || Index >= m_pDataFile->m_Header.m_NumRawData)
+		return;
 
-			// clean up the temporary buffers
-			mem_free(pTemp);
-		}
-		else
-		{
-			// load the data
-			dbg_msg("datafile", "loading data index=%d size=%d", Index, DataSize);
-			m_pDataFile->m_ppDataPtrs[Index] = (char *)mem_alloc(DataSize);
-			m_pDataFile->m_pDataSizes[Index] = DataSize;
-			io_seek(m_pDataFile->m_File, m_pDataFile->m_DataStartOffset+m_pDataFile->m_Info.m_pDataOffsets[Index], IOSEEK_START);
-			io_read(m_pDataFile->m_File, m_pDataFile->m_ppDataPtrs[Index], DataSize);
-		}
+	lock_wait(m_pDataFile->m_Lock);
+	m_pDataFile->m_pPinCount[Index]++;
+	lock_unlock(m_pDataFile->m_Lock);
+}
 
-#if defined(CONF_ARCH_ENDIAN_BIG)
-		if(Swap && SwapSize)
-			swap_endian(m_pDataFile->m_ppDataPtrs[Index], sizeof(int), SwapSize/sizeof(int));
-#endif
-	}
+void CDataFileReader::UnpinData(int Index)
+{
+	if(!m_pDataFile || Index < 0 || Index >= m_pDataFile->m_Header.m_NumRawData)
+		return;
 
-	return m_pDataFile->m_ppDataPtrs[Index];
+	lock_wait(m_pDataFile->m_Lock);
+	dbg_assert(m_pDataFile->m_pPinCount[Index] > 0, "data is not pinned");
+	m_pDataFile->m_pPinCount[Index]--;
+	EvictData(-1);
+	lock_unlock(m_pDataFile->m_Lock);
 }
 
 void *CDataFileReader::GetData(int Index)
@@ -357,6 +1203,57 @@ void CDataFileReader::ReplaceData(int Index, char *pData, int Size)
 	UnloadData(Index);
 	m_pDataFile->m_ppDataPtrs[Index] = pData;
 	m_pDataFile->m_pDataSizes[Index] = Size;
+
+	if(!m_pDataFile->m_pReplaced)
+	{
+		m_pDataFile->m_pReplaced = (bool *)mem_alloc(m_pDataFile->m_Header.m_NumRawData*sizeof(bool));
+		mem_zero(m_pDataFile->m_pReplaced, m_pDataFile->m_Header.m_NumRawData*sizeof(bool));
+	}
+	m_pDataFile->m_pReplaced[Index] = true;
+}
+
+int CDataFileReader::GetDataCodec(int Index) const
+{
+	if(!m_pDataFile || Index < 0 || Index >= m_pDataFile->m_Header.m_NumRawData || !m_pDataFile->m_Info.m_pDataCodecs ||
+		(m_pDataFile->m_pReplaced && m_pDataFile->m_pReplaced[Index]))
+		return DATACODEC_NONE;
+	return m_pDataFile->m_Info.m_pDataCodecs[Index];
+}
+
+int CDataFileReader::GetRawDataSize(int Index) const
+{
+	if(!m_pDataFile || Index < 0 || Index >= m_pDataFile->m_Header.m_NumRawData || m_pDataFile->m_Header.m_Version < 4 ||
+		(m_pDataFile->m_pReplaced && m_pDataFile->m_pReplaced[Index]))
+		return 0;
+	const int Codec = GetDataCodec(Index);
+	if(Codec != DATACODEC_NONE && (Codec != DATACODEC_TILES || m_pDataFile->m_Info.m_pEncodedSizes[Index] < 0))
+		return 0;
+	return GetFileDataSize(Index);
+}
+
+bool CDataFileReader::ReadRawData(int Index, void *pBuffer, int BufferSize, int *pUncompressedSize, int *pCodec, int *pEncodedSize)
+{
+	int DataSize = GetRawDataSize(Index);
+	if(DataSize <= 0 || DataSize > BufferSize)
+		return false;
+
+	if(m_pDataFile->m_pMap)
+	{
+		int64 Offset = (int64)m_pDataFile->m_DataStartOffset+m_pDataFile->m_Info.m_pDataOffsets[Index];
+		if(Offset < 0 || Offset+DataSize > m_pDataFile->m_MapSize)
+			return false;
+		mem_copy(pBuffer, m_pDataFile->m_pMap+Offset, DataSize);
+	}
+	else if(!ReadFileData(Index, pBuffer, DataSize))
+		return false;
+
+	*pUncompressedSize = m_pDataFile->m_Info.m_pDataSizes[Index];
+	const int Codec = GetDataCodec(Index);
+	if(pCodec)
+		*pCodec = Codec;
+	if(pEncodedSize)
+		*pEncodedSize = Codec == DATACODEC_NONE ? *pUncompressedSize : m_pDataFile->m_Info.m_pEncodedSizes[Index];
+	return true;
 }
 
 void CDataFileReader::UnloadData(int Index)
@@ -364,9 +1261,21 @@ void CDataFileReader::UnloadData(int Index)
 	if(Index < 0 || Index >= m_pDataFile->m_Header.m_NumRawData)
 		return;
 
-	mem_free(m_pDataFile->m_ppDataPtrs[Index]);
+	// drop a prefetched copy that hasn't been picked up yet
+	int PrefetchedSize;
+	char *pPrefetched = TakePrefetched(Index, &PrefetchedSize);
+	if(!IsMappedData(m_pDataFile, pPrefetched))
+		mem_free(pPrefetched);
+
+	m_pDataFile->m_MemoryUsed -= m_pDataFile->m_pChargedSizes[Index];
+	m_pDataFile->m_pChargedSizes[Index] = 0;
+	if(!IsMappedData(m_pDataFile, m_pDataFile->m_ppDataPtrs[Index]))
+		mem_free(m_pDataFile->m_ppDataPtrs[Index]);
 	m_pDataFile->m_ppDataPtrs[Index] = 0x0;
 	m_pDataFile->m_pDataSizes[Index] = 0;
+	// the next GetData loads the block of the file again
+	if(m_pDataFile->m_pReplaced)
+		m_pDataFile->m_pReplaced[Index] = false;
 }
 
 int CDataFileReader::GetFileItemSize(int Index) const
@@ -415,31 +1324,31 @@ void CDataFileReader::GetType(int Type, int *pStart, int *pNum)
 	if(!m_pDataFile)
 		return;
 
-	for(int i = 0; i < m_pDataFile->m_Header.m_NumItemTypes; i++)
+	int Entry = FindTypeEntry(m_pDataFile, Type);
+	if(Entry != -1)
 	{
-		if(m_pDataFile->m_Info.m_pItemTypes[i].m_Type == Type)
-		{
-			*pStart = m_pDataFile->m_Info.m_pItemTypes[i].m_Start;
-			*pNum = m_pDataFile->m_Info.m_pItemTypes[i].m_Num;
-			return;
-		}
+		*pStart = m_pDataFile->m_Info.m_pItemTypes[Entry].m_Start;
+		*pNum = m_pDataFile->m_Info.m_pItemTypes[Entry].m_Num;
 	}
 }
 
 void *CDataFileReader::FindItem(int Type, int ID)
 {
-	if(!m_pDataFile) return 0;
+	if(!m_pDataFile || ID < 0 || ID > 0xffff) return 0;
 
-	int Start, Num;
-	GetType(Type, &Start, &Num);
-	for(int i = 0; i < Num; i++)
+	int Entry = FindTypeEntry(m_pDataFile, Type);
+	if(Entry == -1)
+		return 0;
+
+	const CDatafileItemType *pType = &m_pDataFile->m_Info.m_pItemTypes[Entry];
+	for(unsigned Slot = IndexHash((Entry<<16)|ID)&m_pDataFile->m_ItemIndexMask;; Slot = (Slot+1)&m_pDataFile->m_ItemIndexMask)
 	{
-		int ItemID;
-		void *pItem = GetItem(Start+i,0, &ItemID);
-		if(ID == ItemID)
-			return pItem;
+		int Item = m_pDataFile->m_pItemIndex[Slot];
+		if(Item == -1)
+			return 0;
+		if(Item >= pType->m_Start && Item < pType->m_Start+pType->m_Num && (DatafileItem(m_pDataFile, Item)->m_TypeAndID&0xffff) == ID)
+			return GetItem(Item, 0, 0);
 	}
-	return 0;
 }
 
 int CDataFileReader::NumItems() const
@@ -448,34 +1357,88 @@ int CDataFileReader::NumItems() const
 	return m_pDataFile->m_Header.m_NumItems;
 }
 
+void CDataFileReader::StopOpenJob()
+{
+	if(m_pOpenJob)
+	{
+		CancelOpen();
+		WaitOpen();
+		delete m_pOpenJob;
+		m_pOpenJob = 0;
+	}
+}
+
 bool CDataFileReader::Close()
+{
+	StopOpenJob();
+	CloseFile();
+	return true;
+}
+
+void CDataFileReader::CloseFile()
 {
 	if(!m_pDataFile)
-		return true;
+		return;
 
 	// free the data that is loaded
 	int i;
 	for(i = 0; i < m_pDataFile->m_Header.m_NumRawData; i++)
-	{
-		mem_free(m_pDataFile->m_ppDataPtrs[i]);
-		m_pDataFile->m_pDataSizes[i] = 0;
-	}
+		UnloadData(i);
+	delete[] m_pDataFile->m_pPrefetch;
+	mem_free(m_pDataFile->m_pReplaced);
+	mem_free(m_pDataFile->m_pTypeIndex);
+	lock_destroy(m_pDataFile->m_Lock);
 
-	io_close(m_pDataFile->m_File);
+	ReleaseMap(m_pDataFile->m_File, m_pDataFile->m_pMap, m_pDataFile->m_MapSize, m_pDataFile->m_MapType);
 	mem_free(m_pDataFile);
 	m_pDataFile = 0;
-	return true;
+}
+
+void CDataFileReader::CalculateHashes() const
+{
+	lock_wait(m_pDataFile->m_Lock);
+	if(!m_pDataFile->m_HashesDone)
+	{
+		SHA256_CTX Sha256Ctx;
+		sha256_init(&Sha256Ctx);
+		unsigned Crc = crc32(0L, 0x0, 0);
+		// only files are hashed lazily, the mapping can be modified by now
+		if(m_pDataFile->m_File)
+		{
+			unsigned char aBuffer[HASH_BUFFER_SIZE];
+			unsigned Offset = 0;
+			while(1)
+			{
+				unsigned Bytes = io_read_at(m_pDataFile->m_File, aBuffer, HASH_BUFFER_SIZE, Offset);
+				if(Bytes == 0)
+					break;
+				HashData(&Sha256Ctx, &Crc, aBuffer, Bytes);
+				Offset += Bytes;
+			}
+		}
+		m_pDataFile->m_Sha256 = sha256_finish(&Sha256Ctx);
+		m_pDataFile->m_Crc = Crc;
+		m_pDataFile->m_HashesDone = true;
+	}
+	lock_unlock(m_pDataFile->m_Lock);
+}
+
+unsigned CDataFileReader::Serial() const
+{
+	return m_pDataFile ? m_pDataFile->m_Serial : 0;
 }
 
 SHA256_DIGEST CDataFileReader::Sha256() const
 {
 	if(!m_pDataFile) return SHA256_ZEROED;
+	CalculateHashes();
 	return m_pDataFile->m_Sha256;
 }
 
 unsigned CDataFileReader::Crc() const
 {
 	if(!m_pDataFile) return 0xFFFFFFFF;
+	CalculateHashes();
 	return m_pDataFile->m_Crc;
 }
 
@@ -504,106 +1467,452 @@ bool CDataFileReader::CheckSha256(IOHANDLE Handle, const void *pSha256)
 CDataFileWriter::CDataFileWriter()
 {
 	m_File = 0;
-	m_pItemTypes = static_cast<CItemTypeInfo *>(mem_alloc(sizeof(CItemTypeInfo) * MAX_ITEM_TYPES));
-	m_pItems = static_cast<CItemInfo *>(mem_alloc(sizeof(CItemInfo) * MAX_ITEMS));
-	m_pDatas = static_cast<CDataInfo *>(mem_alloc(sizeof(CDataInfo) * MAX_DATAS));
+	m_ToMemory = false;
+	m_pMemory = 0;
+	m_MemorySize = 0;
+	m_MemoryCapacity = 0;
+	m_pJobPool = 0;
+	m_Compression = COMPRESSION_DEFAULT;
+	m_Dedup = false;
+	m_Streaming = false;
+	m_pStorage = 0;
+	m_SpillFile = 0;
+	m_aSpillFilename[0] = 0;
+	m_NumSpilled = 0;
+	m_WriteFailed = false;
 }
 
 CDataFileWriter::~CDataFileWriter()
 {
-	mem_free(m_pItemTypes);
-	m_pItemTypes = 0;
-	mem_free(m_pItems);
-	m_pItems = 0;
-	mem_free(m_pDatas);
-	m_pDatas = 0;
+	// Finish never ran, drop the unfinished file and its spilled data
+	for(int i = 0; i < m_Items.size(); i++)
+		mem_free(m_Items[i].m_pData);
+	for(int i = 0; i < m_Datas.size(); i++)
+	{
+		mem_free(m_Datas[i].m_pCompressedData);
+		mem_free(m_Datas[i].m_pUncompressedData);
+	}
+	if(m_File)
+		io_close(m_File);
+	if(m_SpillFile)
+	{
+		io_close(m_SpillFile);
+		m_pStorage->RemoveFile(m_aSpillFilename, IStorage::TYPE_SAVE);
+	}
+	mem_free(m_pMemory);
 }
 
-bool CDataFileWriter::Open(class IStorage *pStorage, const char *pFilename)
+bool CDataFileWriter::Open(class IStorage *pStorage, const char *pFilename, CJobPool *pJobPool)
 {
-	dbg_assert(!m_File, "a file already exists");
+	dbg_assert(!IsOpen(), "a file already exists");
 	m_File = pStorage->OpenFile(pFilename, IOFLAG_WRITE, IStorage::TYPE_SAVE);
 	if(!m_File)
 		return false;
 
-	m_NumItems = 0;
-	m_NumDatas = 0;
-	m_NumItemTypes = 0;
-	mem_zero(m_pItemTypes, sizeof(CItemTypeInfo) * MAX_ITEM_TYPES);
+	Reset(pJobPool);
 
-	for(int i = 0; i < MAX_ITEM_TYPES; i++)
+	// the data section is collected in a file next to the output
+	if(m_Streaming)
 	{
-		m_pItemTypes[i].m_First = -1;
-		m_pItemTypes[i].m_Last = -1;
+		m_pStorage = pStorage;
+		str_format(m_aSpillFilename, sizeof(m_aSpillFilename), "%s.data.tmp", pFilename);
+		m_SpillFile = pStorage->OpenFile(m_aSpillFilename, IOFLAG_WRITE, IStorage::TYPE_SAVE);
+		if(!m_SpillFile)
+			dbg_msg("datafile", "could not open '%s', keeping the data in memory", m_aSpillFilename);
 	}
+	return true;
+}
 
+bool CDataFileWriter::OpenMemory(CJobPool *pJobPool)
+{
+	dbg_assert(!IsOpen(), "a file already exists");
+	m_ToMemory = true;
+	Reset(pJobPool);
 	return true;
 }
 
+void *CDataFileWriter::ReleaseMemory(unsigned *pSize)
+{
+	void *pMemory = m_pMemory;
+	*pSize = m_MemorySize;
+	m_pMemory = 0;
+	m_MemorySize = 0;
+	m_MemoryCapacity = 0;
+	return pMemory;
+}
+
+void CDataFileWriter::Reset(CJobPool *pJobPool)
+{
+	mem_free(m_pMemory);
+	m_pMemory = 0;
+	m_MemorySize = 0;
+	m_MemoryCapacity = 0;
+	m_pJobPool = pJobPool;
+	m_ItemTypes.clear();
+	m_Items.clear();
+	m_Datas.clear();
+	m_DedupTable.clear();
+	m_NumSpilled = 0;
+	m_WriteFailed = false;
+}
+
+void CDataFileWriter::SpillData()
+{
+	if(!m_SpillFile)
+		return;
+
+	// blocks have to end up in the data section in order, a pending block stops the spilling
+	for(; m_NumSpilled < m_Datas.size() && !m_Datas[m_NumSpilled].m_pUncompressedData; m_NumSpilled++)
+	{
+		CDataInfo *pInfo = &m_Datas[m_NumSpilled];
+		if(io_write(m_SpillFile, pInfo->m_pCompressedData, pInfo->m_CompressedSize) != (unsigned)pInfo->m_CompressedSize)
+			m_WriteFailed = true;
+		mem_free(pInfo->m_pCompressedData);
+		pInfo->m_pCompressedData = 0;
+	}
+}
+
+void CDataFileWriter::ReserveMemory(unsigned Size)
+{
+	if(Size <= m_MemoryCapacity)
+		return;
+
+	char *pMemory = (char *)mem_alloc(Size);
+	mem_copy(pMemory, m_pMemory, m_MemorySize);
+	mem_free(m_pMemory);
+	m_pMemory = pMemory;
+	m_MemoryCapacity = Size;
+}
+
+void CDataFileWriter::Write(const void *pData, unsigned Size)
+{
+	if(m_File)
+	{
+		if(io_write(m_File, pData, Size) != Size)
+			m_WriteFailed = true;
+		return;
+	}
+
+	if(m_MemorySize+Size > m_MemoryCapacity)
+		ReserveMemory(maximum(m_MemorySize+Size, maximum(m_MemoryCapacity*2, 4096u)));
+	mem_copy(m_pMemory+m_MemorySize, pData, Size);
+	m_MemorySize += Size;
+}
+
 int CDataFileWriter::AddItem(int Type, int ID, int Size, const void *pData)
 {
-	if(!m_File) return 0;
+	if(!IsOpen()) return 0;
 
 	dbg_assert(Type >= 0 && Type < 0xFFFF, "incorrect type");
-	dbg_assert(m_NumItems < 1024, "too many items");
 	dbg_assert(Size%sizeof(int) == 0, "incorrect boundary");
 
-	m_pItems[m_NumItems].m_Type = Type;
-	m_pItems[m_NumItems].m_ID = ID;
-	m_pItems[m_NumItems].m_Size = Size;
+	int Index = m_Items.size();
+	CItemInfo Item;
+	Item.m_Type = Type;
+	Item.m_ID = ID;
+	Item.m_Size = Size;
 
 	// copy data
-	m_pItems[m_NumItems].m_pData = mem_alloc(Size);
-	mem_copy(m_pItems[m_NumItems].m_pData, pData, Size);
-
-	if(!m_pItemTypes[Type].m_Num) // count item types
-		m_NumItemTypes++;
+	Item.m_pData = mem_alloc(Size);
+	mem_copy(Item.m_pData, pData, Size);
+
+	// find the type or add it
+	CItemTypeInfo TypeInfo;
+	TypeInfo.m_Type = Type;
+	sorted_array<CItemTypeInfo>::range r = find_binary(m_ItemTypes.all(), TypeInfo);
+	CItemTypeInfo *pTypeInfo;
+	if(r.empty())
+	{
+		TypeInfo.m_Num = 0;
+		TypeInfo.m_First = -1;
+		TypeInfo.m_Last = -1;
+		pTypeInfo = &m_ItemTypes[m_ItemTypes.add(TypeInfo)];
+	}
+	else
+		pTypeInfo = &r.front();
 
 	// link
-	m_pItems[m_NumItems].m_Prev = m_pItemTypes[Type].m_Last;
-	m_pItems[m_NumItems].m_Next = -1;
+	Item.m_Prev = pTypeInfo->m_Last;
+	Item.m_Next = -1;
+
+	if(pTypeInfo->m_Last != -1)
+		m_Items[pTypeInfo->m_Last].m_Next = Index;
+	pTypeInfo->m_Last = Index;
+
+	if(pTypeInfo->m_First == -1)
+		pTypeInfo->m_First = Index;
 
-	if(m_pItemTypes[Type].m_Last != -1)
-		m_pItems[m_pItemTypes[Type].m_Last].m_Next = m_NumItems;
-	m_pItemTypes[Type].m_Last = m_NumItems;
+	pTypeInfo->m_Num++;
 
-	if(m_pItemTypes[Type].m_First == -1)
-		m_pItemTypes[Type].m_First = m_NumItems;
+	m_Items.add(Item);
+	return Index;
+}
+
+int CDataFileWriter::AddData(int Size, const void *pData, int Compression)
+{
+	return AddDataImpl(Size, pData, Compression, DATACODEC_NONE);
+}
+
+int CDataFileWriter::AddTileData(int Size, const void *pData, int Compression)
+{
+	// anything that isn't made of whole tiles is stored as it is
+	return AddDataImpl(Size, pData, Compression, Size%TILE_SIZE ? DATACODEC_NONE : DATACODEC_TILES);
+}
+
+int CDataFileWriter::AddDataImpl(int Size, const void *pData, int Compression, int Codec)
+{
+	if(!IsOpen()) return 0;
+
+	dbg_assert(Compression >= COMPRESSION_WRITER && Compression <= COMPRESSION_AUTO, "incorrect compression");
+
+	CDataInfo Info;
+	Info.m_Compression = Compression == COMPRESSION_WRITER ? m_Compression : Compression;
+	Info.m_Codec = Codec;
+	Info.m_UncompressedSize = Size;
+	Info.m_EncodedSize = Size;
+	Info.m_CompressedSize = 0;
+	Info.m_pCompressedData = 0;
+	Info.m_pUncompressedData = 0;
+	Info.m_Raw = false;
+	if(m_Dedup)
+	{
+		Info.m_Hash = sha256(pData, Size);
+		int Duplicate = FindDuplicate(&Info);
+		if(Duplicate >= 0)
+			return Duplicate;
+	}
+
+	// without a job pool the block gets compressed right away
+	if(m_pJobPool)
+	{
+		Info.m_pUncompressedData = mem_alloc(Size);
+		mem_copy(Info.m_pUncompressedData, pData, Size);
+	}
+	else
+		CompressData(&Info, pData);
+
+	return InsertData(&Info);
+}
+
+int CDataFileWriter::AddDataRaw(int UncompressedSize, int CompressedSize, const void *pCompressedData, int Codec, int EncodedSize)
+{
+	if(!IsOpen()) return 0;
+
+	dbg_assert(Codec == DATACODEC_NONE || Codec == DATACODEC_TILES, "incorrect codec");
+
+	void *pCopy = mem_alloc(CompressedSize);
+	mem_copy(pCopy, pCompressedData, CompressedSize);
+	return AddRawInfo(UncompressedSize, CompressedSize, pCopy, Codec, EncodedSize);
+}
+
+int CDataFileWriter::AddRawInfo(int UncompressedSize, int CompressedSize, void *pCompressedData, int Codec, int EncodedSize)
+{
+	CDataInfo Info;
+	Info.m_UncompressedSize = UncompressedSize;
+	Info.m_EncodedSize = Codec == DATACODEC_NONE ? UncompressedSize : EncodedSize;
+	Info.m_Codec = Codec;
+	Info.m_CompressedSize = CompressedSize;
+	Info.m_pCompressedData = pCompressedData;
+	Info.m_pUncompressedData = 0;
+	Info.m_Compression = COMPRESSION_WRITER;
+	Info.m_Raw = true;
+	if(m_Dedup)
+	{
+		// raw blocks are keyed by their compressed bytes, they only match other raw blocks
+		Info.m_Hash = sha256(pCompressedData, CompressedSize);
+		int Duplicate = FindDuplicate(&Info);
+		if(Duplicate >= 0)
+		{
+			mem_free(pCompressedData);
+			return Duplicate;
+		}
+	}
+	return InsertData(&Info);
+}
+
+static unsigned DedupHash(const SHA256_DIGEST &Hash)
+{
+	return Hash.data[0]|(Hash.data[1]<<8)|(Hash.data[2]<<16)|((unsigned)Hash.data[3]<<24);
+}
+
+int CDataFileWriter::FindDuplicate(const CDataInfo *pInfo) const
+{
+	if(!m_DedupTable.size())
+		return -1;
+
+	unsigned Mask = m_DedupTable.size()-1;
+	for(unsigned Slot = DedupHash(pInfo->m_Hash)&Mask; m_DedupTable[Slot] != -1; Slot = (Slot+1)&Mask)
+	{
+		const CDataInfo *pOther = &m_Datas[m_DedupTable[Slot]];
+		if(pOther->m_Raw == pInfo->m_Raw && pOther->m_Codec == pInfo->m_Codec && pOther->m_UncompressedSize == pInfo->m_UncompressedSize &&
+			(!pInfo->m_Raw || pOther->m_CompressedSize == pInfo->m_CompressedSize) && pOther->m_Hash == pInfo->m_Hash)
+			return m_DedupTable[Slot];
+	}
+	return -1;
+}
+
+int CDataFileWriter::InsertData(const CDataInfo *pInfo)
+{
+	int Index = m_Datas.add(*pInfo);
+	SpillData();
+	if(!m_Dedup)
+		return Index;
+
+	// keep the table at most half full
+	if(m_Datas.size()*2 > m_DedupTable.size())
+	{
+		int Size = 64;
+		while(Size < m_Datas.size()*4)
+			Size *= 2;
+		m_DedupTable.set_size(Size);
+		for(int i = 0; i < Size; i++)
+			m_DedupTable[i] = -1;
+		for(int i = 0; i < m_Datas.size(); i++)
+			InsertDuplicateSlot(i);
+	}
+	else
+		InsertDuplicateSlot(Index);
+	return Index;
+}
+
+void CDataFileWriter::InsertDuplicateSlot(int Index)
+{
+	unsigned Mask = m_DedupTable.size()-1;
+	unsigned Slot = DedupHash(m_Datas[Index].m_Hash)&Mask;
+	while(m_DedupTable[Slot] != -1)
+		Slot = (Slot+1)&Mask;
+	m_DedupTable[Slot] = Index;
+}
+
+int CDataFileWriter::AddDataFrom(CDataFileReader *pReader, int Index)
+{
+	if(!IsOpen()) return 0;
 
-	m_pItemTypes[Type].m_Num++;
+	// copy the compressed bytes when possible, fall back to recompressing
+	int CompressedSize = pReader->GetRawDataSize(Index);
+	if(CompressedSize > 0)
+	{
+		void *pCompressedData = mem_alloc(CompressedSize);
+		int UncompressedSize, Codec, EncodedSize;
+		if(pReader->ReadRawData(Index, pCompressedData, CompressedSize, &UncompressedSize, &Codec, &EncodedSize))
+			return AddRawInfo(UncompressedSize, CompressedSize, pCompressedData, Codec, EncodedSize);
+		mem_free(pCompressedData);
+	}
 
-	m_NumItems++;
-	return m_NumItems-1;
+	// the block can be corrupt or unreadable
+	void *pData = pReader->GetData(Index);
+	if(!pData)
+		return -1;
+	if(pReader->GetDataCodec(Index) == DATACODEC_TILES)
+		return AddTileData(pReader->GetDataSize(Index), pData);
+	return AddData(pReader->GetDataSize(Index), pData);
 }
 
-int CDataFileWriter::AddData(int Size, const void *pData)
+void CDataFileWriter::CompressData(CDataInfo *pInfo, const void *pData)
 {
-	if(!m_File) return 0;
+	// the transform runs first, the compression works on its output
+	void *pEncoded = 0;
+	if(pInfo->m_Codec == DATACODEC_TILES)
+	{
+		pEncoded = mem_alloc(TileEncodeBound(pInfo->m_UncompressedSize));
+		pInfo->m_EncodedSize = EncodeTiles((const unsigned char *)pData, pInfo->m_UncompressedSize, (unsigned char *)pEncoded);
+		pData = pEncoded;
+	}
+	const int Size = pInfo->m_EncodedSize;
 
-	dbg_assert(m_NumDatas < 1024, "too much data");
+	int Level = Z_DEFAULT_COMPRESSION;
+	switch(pInfo->m_Compression)
+	{
+	case COMPRESSION_STORE: Level = Z_NO_COMPRESSION; break;
+	case COMPRESSION_FAST: Level = Z_BEST_SPEED; break;
+	case COMPRESSION_MAX: Level = Z_BEST_COMPRESSION; break;
+	case COMPRESSION_AUTO:
+		{
+			// probe the start of the block at the fastest level, already noisy data is not worth the time
+			enum { PROBE_SIZE=4096 };
+			Bytef aProbe[PROBE_SIZE*2];
+			uLongf ProbeSize = sizeof(aProbe);
+			uLong SampleSize = Size < PROBE_SIZE ? Size : PROBE_SIZE;
+			if(compress2(aProbe, &ProbeSize, (const Bytef*)pData, SampleSize, Z_BEST_SPEED) == Z_OK && ProbeSize*10 >= SampleSize*9) // ignore_convention
+				Level = Z_NO_COMPRESSION;
+		}
+		break;
+	}
 
-	CDataInfo *pInfo = &m_pDatas[m_NumDatas];
 	unsigned long s = compressBound(Size);
-	void *pCompData = mem_alloc(s); // temporary buffer that we use during compression
+	pInfo->m_pCompressedData = mem_alloc(s);
 
-	int Result = compress((Bytef*)pCompData, &s, (Bytef*)pData, Size); // ignore_convention
+	int Result = compress2((Bytef*)pInfo->m_pCompressedData, &s, (Bytef*)pData, Size, Level); // ignore_convention
 	if(Result != Z_OK)
 	{
 		dbg_msg("datafile", "compression error %d", Result);
 		dbg_assert(0, "zlib error");
 	}
-
-	pInfo->m_UncompressedSize = Size;
 	pInfo->m_CompressedSize = (int)s;
-	pInfo->m_pCompressedData = mem_alloc(pInfo->m_CompressedSize);
-	mem_copy(pInfo->m_pCompressedData, pCompData, pInfo->m_CompressedSize);
-	mem_free(pCompData);
 
-	m_NumDatas++;
-	return m_NumDatas-1;
+	// only shrink the buffer when there is a lot of slack left, copying the compressed data is cheap
+	if(s < compressBound(Size)/4*3)
+	{
+		void *pCompressed = mem_alloc(pInfo->m_CompressedSize);
+		mem_copy(pCompressed, pInfo->m_pCompressedData, pInfo->m_CompressedSize);
+		mem_free(pInfo->m_pCompressedData);
+		pInfo->m_pCompressedData = pCompressed;
+	}
+	mem_free(pEncoded);
+}
+
+int CDataFileWriter::CompressJob(void *pUser)
+{
+	CDatafileCompressJob *pJob = static_cast<CDatafileCompressJob *>(pUser);
+	if(atomic_compswap(&pJob->m_Claimed, 0, 1) == 0)
+	{
+		CDataInfo *pInfo = static_cast<CDataInfo *>(pJob->m_pInfo);
+		CompressData(pInfo, pInfo->m_pUncompressedData);
+		mem_free(pInfo->m_pUncompressedData);
+		pInfo->m_pUncompressedData = 0;
+	}
+	return 0;
+}
+
+void CDataFileWriter::Flush()
+{
+	int NumPending = 0;
+	for(int i = 0; i < m_Datas.size(); i++)
+	{
+		if(m_Datas[i].m_pUncompressedData)
+			NumPending++;
+	}
+	if(!NumPending)
+	{
+		SpillData();
+		return;
+	}
+
+	CDatafileCompressJob *pJobs = new CDatafileCompressJob[NumPending];
+	for(int i = 0, j = 0; i < m_Datas.size(); i++)
+	{
+		if(!m_Datas[i].m_pUncompressedData)
+			continue;
+		pJobs[j].m_Claimed = 0;
+		pJobs[j].m_pInfo = &m_Datas[i];
+		m_pJobPool->Add(&pJobs[j].m_Job, CompressJob, &pJobs[j]);
+		j++;
+	}
+
+	// help out from the back of the queue, then wait for the workers
+	for(int j = NumPending-1; j >= 0; j--)
+		CompressJob(&pJobs[j]);
+	for(int j = 0; j < NumPending; j++)
+	{
+		while(pJobs[j].m_Job.Status() != CJob::STATE_DONE)
+			thread_yield();
+	}
+	sync_barrier();
+	delete[] pJobs;
+	SpillData();
 }
 
-int CDataFileWriter::AddDataSwapped(int Size, const void *pData)
+int CDataFileWriter::AddDataSwapped(int Size, const void *pData, int Compression)
 {
 	dbg_assert(Size%sizeof(int) == 0, "incorrect boundary");
 
@@ -611,19 +1920,24 @@ int CDataFileWriter::AddDataSwapped(int Size, const void *pData)
 	void *pSwapped = mem_alloc(Size); // temporary buffer that we use during compression
 	mem_copy(pSwapped, pData, Size);
 	swap_endian(pSwapped, sizeof(int), Size/sizeof(int));
-	int Index = AddData(Size, pSwapped);
+	int Index = AddData(Size, pSwapped, Compression);
 	mem_free(pSwapped);
 	return Index;
 #else
-	return AddData(Size, pData);
+	return AddData(Size, pData, Compression);
 #endif
 }
 
 
 int CDataFileWriter::Finish()
 {
-	if(!m_File) return 0;
+	if(!IsOpen()) return 0;
+
+	Flush();
 
+	const int NumItems = m_Items.size();
+	const int NumDatas = m_Datas.size();
+	const int NumItemTypes = m_ItemTypes.size();
 	int ItemSize = 0;
 	int TypesSize, HeaderSize, OffsetSize, FileSize, SwapSize;
 	int DataSize = 0;
@@ -634,28 +1948,39 @@ int CDataFileWriter::Finish()
 		dbg_msg("datafile", "writing");
 
 	// calculate sizes
-	for(int i = 0; i < m_NumItems; i++)
+	for(int i = 0; i < NumItems; i++)
 	{
 		if(DEBUG)
-			dbg_msg("datafile", "item=%d size=%d (%d)", i, m_pItems[i].m_Size, (int)(m_pItems[i].m_Size+sizeof(CDatafileItem)));
-		ItemSize += m_pItems[i].m_Size + sizeof(CDatafileItem);
+			dbg_msg("datafile", "item=%d size=%d (%d)", i, m_Items[i].m_Size, (int)(m_Items[i].m_Size+sizeof(CDatafileItem)));
+		ItemSize += m_Items[i].m_Size + sizeof(CDatafileItem);
 	}
 
 
-	for(int i = 0; i < m_NumDatas; i++)
-		DataSize += m_pDatas[i].m_CompressedSize;
+	// transformed blocks need a v5 reader, keep writing v4 without them
+	int Version = 4;
+	for(int i = 0; i < NumDatas; i++)
+	{
+		DataSize += m_Datas[i].m_CompressedSize;
+		if(m_Datas[i].m_Codec != DATACODEC_NONE)
+			Version = 5;
+	}
 
 	// calculate the complete size
-	TypesSize = m_NumItemTypes*sizeof(CDatafileItemType);
+	TypesSize = NumItemTypes*sizeof(CDatafileItemType);
 	HeaderSize = sizeof(CDatafileHeader);
-	OffsetSize = (m_NumItems + m_NumDatas + m_NumDatas) * sizeof(int); // ItemOffsets, DataOffsets, DataUncompressedSizes
+	OffsetSize = (NumItems + NumDatas + NumDatas) * sizeof(int); // ItemOffsets, DataOffsets, DataUncompressedSizes
+	if(Version == 5)
+		OffsetSize += (NumDatas + NumDatas) * sizeof(int); // DataCodecs, DataEncodedSizes
 	FileSize = HeaderSize + TypesSize + OffsetSize + ItemSize + DataSize;
 	SwapSize = FileSize - DataSize;
 
 	(void)SwapSize;
 
 	if(DEBUG)
-		dbg_msg("datafile", "num_m_aItemTypes=%d TypesSize=%d m_aItemsize=%d DataSize=%d", m_NumItemTypes, TypesSize, ItemSize, DataSize);
+		dbg_msg("datafile", "num_m_aItemTypes=%d TypesSize=%d m_aItemsize=%d DataSize=%d", NumItemTypes, TypesSize, ItemSize, DataSize);
+
+	if(m_ToMemory)
+		ReserveMemory(FileSize);
 
 	// construct Header
 	{
@@ -663,12 +1988,12 @@ int CDataFileWriter::Finish()
 		Header.m_aID[1] = 'A';
 		Header.m_aID[2] = 'T';
 		Header.m_aID[3] = 'A';
-		Header.m_Version = 4;
+		Header.m_Version = Version;
 		Header.m_Size = FileSize - 16;
 		Header.m_Swaplen = SwapSize - 16;
-		Header.m_NumItemTypes = m_NumItemTypes;
-		Header.m_NumItems = m_NumItems;
-		Header.m_NumRawData = m_NumDatas;
+		Header.m_NumItemTypes = NumItemTypes;
+		Header.m_NumItems = NumItems;
+		Header.m_NumRawData = NumDatas;
 		Header.m_ItemSize = ItemSize;
 		Header.m_DataSize = DataSize;
 
@@ -678,55 +2003,45 @@ int CDataFileWriter::Finish()
 #if defined(CONF_ARCH_ENDIAN_BIG)
 		swap_endian(&Header, sizeof(int), sizeof(Header)/sizeof(int));
 #endif
-		io_write(m_File, &Header, sizeof(Header));
+		Write(&Header, sizeof(Header));
 	}
 
 	// write types
-	for(int i = 0, Count = 0; i < 0xffff; i++)
+	for(int i = 0, Count = 0; i < NumItemTypes; i++)
 	{
-		if(m_pItemTypes[i].m_Num)
-		{
-			// write info
-			CDatafileItemType Info;
-			Info.m_Type = i;
-			Info.m_Start = Count;
-			Info.m_Num = m_pItemTypes[i].m_Num;
-			if(DEBUG)
-				dbg_msg("datafile", "writing type=%x start=%d num=%d", Info.m_Type, Info.m_Start, Info.m_Num);
+		// write info
+		CDatafileItemType Info;
+		Info.m_Type = m_ItemTypes[i].m_Type;
+		Info.m_Start = Count;
+		Info.m_Num = m_ItemTypes[i].m_Num;
+		if(DEBUG)
+			dbg_msg("datafile", "writing type=%x start=%d num=%d", Info.m_Type, Info.m_Start, Info.m_Num);
 #if defined(CONF_ARCH_ENDIAN_BIG)
-			swap_endian(&Info, sizeof(int), sizeof(CDatafileItemType)/sizeof(int));
+		swap_endian(&Info, sizeof(int), sizeof(CDatafileItemType)/sizeof(int));
 #endif
-			io_write(m_File, &Info, sizeof(Info));
-			Count += m_pItemTypes[i].m_Num;
-		}
+		Write(&Info, sizeof(Info));
+		Count += m_ItemTypes[i].m_Num;
 	}
 
 	// write item offsets
-	for(int i = 0, Offset = 0; i < 0xffff; i++)
+	for(int i = 0, Offset = 0; i < NumItemTypes; i++)
 	{
-		if(m_pItemTypes[i].m_Num)
+		// write all items in of this type
+		for(int k = m_ItemTypes[i].m_First; k != -1; k = m_Items[k].m_Next)
 		{
-			// write all m_pItems in of this type
-			int k = m_pItemTypes[i].m_First;
-			while(k != -1)
-			{
-				if(DEBUG)
-					dbg_msg("datafile", "writing item offset num=%d offset=%d", k, Offset);
-				int Temp = Offset;
+			if(DEBUG)
+				dbg_msg("datafile", "writing item offset num=%d offset=%d", k, Offset);
+			int Temp = Offset;
 #if defined(CONF_ARCH_ENDIAN_BIG)
-				swap_endian(&Temp, sizeof(int), sizeof(Temp)/sizeof(int));
+			swap_endian(&Temp, sizeof(int), sizeof(Temp)/sizeof(int));
 #endif
-				io_write(m_File, &Temp, sizeof(Temp));
-				Offset += m_pItems[k].m_Size + sizeof(CDatafileItem);
-
-				// next
-				k = m_pItems[k].m_Next;
-			}
+			Write(&Temp, sizeof(Temp));
+			Offset += m_Items[k].m_Size + sizeof(CDatafileItem);
 		}
 	}
 
 	// write data offsets
-	for(int i = 0, Offset = 0; i < m_NumDatas; i++)
+	for(int i = 0, Offset = 0; i < NumDatas; i++)
 	{
 		if(DEBUG)
 			dbg_msg("datafile", "writing data offset num=%d offset=%d", i, Offset);
@@ -734,66 +2049,121 @@ int CDataFileWriter::Finish()
 #if defined(CONF_ARCH_ENDIAN_BIG)
 		swap_endian(&Temp, sizeof(int), sizeof(Temp)/sizeof(int));
 #endif
-		io_write(m_File, &Temp, sizeof(Temp));
-		Offset += m_pDatas[i].m_CompressedSize;
+		Write(&Temp, sizeof(Temp));
+		Offset += m_Datas[i].m_CompressedSize;
 	}
 
 	// write data uncompressed sizes
-	for(int i = 0; i < m_NumDatas; i++)
+	for(int i = 0; i < NumDatas; i++)
 	{
 		if(DEBUG)
-			dbg_msg("datafile", "writing data uncompressed size num=%d size=%d", i, m_pDatas[i].m_UncompressedSize);
-		int UncompressedSize = m_pDatas[i].m_UncompressedSize;
+			dbg_msg("datafile", "writing data uncompressed size num=%d size=%d", i, m_Datas[i].m_UncompressedSize);
+		int UncompressedSize = m_Datas[i].m_UncompressedSize;
 #if defined(CONF_ARCH_ENDIAN_BIG)
 		swap_endian(&UncompressedSize, sizeof(int), sizeof(UncompressedSize)/sizeof(int));
 #endif
-		io_write(m_File, &UncompressedSize, sizeof(UncompressedSize));
+		Write(&UncompressedSize, sizeof(UncompressedSize));
 	}
 
-	// write m_pItems
-	for(int i = 0; i < 0xffff; i++)
+	// write data codecs and encoded sizes
+	if(Version == 5)
 	{
-		if(m_pItemTypes[i].m_Num)
+		for(int i = 0; i < NumDatas; i++)
 		{
-			// write all m_pItems in of this type
-			int k = m_pItemTypes[i].m_First;
-			while(k != -1)
-			{
-				CDatafileItem Item;
-				Item.m_TypeAndID = (i<<16)|m_pItems[k].m_ID;
-				Item.m_Size = m_pItems[k].m_Size;
-				if(DEBUG)
-					dbg_msg("datafile", "writing item type=%x idx=%d id=%d size=%d", i, k, m_pItems[k].m_ID, m_pItems[k].m_Size);
-
+			int Codec = m_Datas[i].m_Codec;
+#if defined(CONF_ARCH_ENDIAN_BIG)
+			swap_endian(&Codec, sizeof(int), sizeof(Codec)/sizeof(int));
+#endif
+			Write(&Codec, sizeof(Codec));
+		}
+		for(int i = 0; i < NumDatas; i++)
+		{
+			int EncodedSize = m_Datas[i].m_EncodedSize;
 #if defined(CONF_ARCH_ENDIAN_BIG)
-				swap_endian(&Item, sizeof(int), sizeof(Item)/sizeof(int));
-				swap_endian(m_pItems[k].m_pData, sizeof(int), m_pItems[k].m_Size/sizeof(int));
+			swap_endian(&EncodedSize, sizeof(int), sizeof(EncodedSize)/sizeof(int));
 #endif
-				io_write(m_File, &Item, sizeof(Item));
-				io_write(m_File, m_pItems[k].m_pData, m_pItems[k].m_Size);
+			Write(&EncodedSize, sizeof(EncodedSize));
+		}
+	}
 
-				// next
-				k = m_pItems[k].m_Next;
-			}
+	// write items
+	for(int i = 0; i < NumItemTypes; i++)
+	{
+		// write all items in of this type
+		const int Type = m_ItemTypes[i].m_Type;
+		for(int k = m_ItemTypes[i].m_First; k != -1; k = m_Items[k].m_Next)
+		{
+			CDatafileItem Item;
+			Item.m_TypeAndID = (Type<<16)|m_Items[k].m_ID;
+			Item.m_Size = m_Items[k].m_Size;
+			if(DEBUG)
+				dbg_msg("datafile", "writing item type=%x idx=%d id=%d size=%d", Type, k, m_Items[k].m_ID, m_Items[k].m_Size);
+
+#if defined(CONF_ARCH_ENDIAN_BIG)
+			swap_endian(&Item, sizeof(int), sizeof(Item)/sizeof(int));
+			swap_endian(m_Items[k].m_pData, sizeof(int), m_Items[k].m_Size/sizeof(int));
+#endif
+			Write(&Item, sizeof(Item));
+			Write(m_Items[k].m_pData, m_Items[k].m_Size);
 		}
 	}
 
 	// write data
-	for(int i = 0; i < m_NumDatas; i++)
+	if(m_SpillFile)
 	{
-		if(DEBUG)
-			dbg_msg("datafile", "writing data id=%d size=%d", i, m_pDatas[i].m_CompressedSize);
-		io_write(m_File, m_pDatas[i].m_pCompressedData, m_pDatas[i].m_CompressedSize);
+		// copy the spilled data section over
+		io_close(m_SpillFile);
+		m_SpillFile = m_pStorage->OpenFile(m_aSpillFilename, IOFLAG_READ, IStorage::TYPE_SAVE);
+		char aBuffer[64*1024];
+		int Left = DataSize;
+		while(m_SpillFile && Left > 0)
+		{
+			unsigned Bytes = io_read(m_SpillFile, aBuffer, minimum(Left, (int)sizeof(aBuffer)));
+			if(Bytes == 0)
+				break;
+			Write(aBuffer, Bytes);
+			Left -= Bytes;
+		}
+		if(Left)
+		{
+			dbg_msg("datafile", "failed to copy the data from '%s'", m_aSpillFilename);
+			m_WriteFailed = true;
+		}
+		if(m_SpillFile)
+			io_close(m_SpillFile);
+		m_SpillFile = 0;
+		m_pStorage->RemoveFile(m_aSpillFilename, IStorage::TYPE_SAVE);
+	}
+	else
+	{
+		for(int i = 0; i < NumDatas; i++)
+		{
+			if(DEBUG)
+				dbg_msg("datafile", "writing data id=%d size=%d", i, m_Datas[i].m_CompressedSize);
+			Write(m_Datas[i].m_pCompressedData, m_Datas[i].m_CompressedSize);
+		}
 	}
 
 	// free data
-	for(int i = 0; i < m_NumItems; i++)
-		mem_free(m_pItems[i].m_pData);
-	for(int i = 0; i < m_NumDatas; ++i)
-		mem_free(m_pDatas[i].m_pCompressedData);
-
-	io_close(m_File);
+	for(int i = 0; i < NumItems; i++)
+		mem_free(m_Items[i].m_pData);
+	for(int i = 0; i < NumDatas; ++i)
+		mem_free(m_Datas[i].m_pCompressedData);
+	m_ItemTypes.clear();
+	m_Items.clear();
+	m_Datas.clear();
+	m_DedupTable.clear();
+
+	if(m_File)
+		io_close(m_File);
 	m_File = 0;
+	m_ToMemory = false;
+
+	if(m_WriteFailed)
+	{
+		dbg_msg("datafile", "failed to write the file");
+		return 0;
+	}
 
 	if(DEBUG)
 		dbg_msg("datafile", "done");
@@ -5,21 +5,83 @@
 
 #include <base/system.h>
 #include <base/hash.h>
+#include <base/tl/array.h>
+#include <base/tl/sorted_array.h>
+
+// transforms that run on a data block before it gets compressed (datafile v5)
+enum
+{
+	DATACODEC_NONE=0,
+	// 4 byte tile records, the third byte (the skip) is dropped and restored as 0
+	DATACODEC_TILES,
+};
 
 // raw datafile access
+// GetData and GetDataSwapped may be called from several threads at once unless a memory
+// budget is set, everything else must not run concurrently with other calls.
 class CDataFileReader
 {
 	struct CDatafile *m_pDataFile;
+	struct CDatafileOpenJob *m_pOpenJob;
+	int64 m_MemoryBudget;
+	bool OpenStorage(class IStorage *pStorage, const char *pFilename, int StorageType, int Flags, struct CDatafileOpenJob *pJob);
+	bool OpenImpl(IOHANDLE File, char *pMap, unsigned MapSize, int MapType, int Flags, const char *pName, struct CDatafileOpenJob *pJob);
+	static int OpenJob(void *pUser);
+	void StopOpenJob();
+	void CloseFile();
+	bool ReadFileData(int Index, void *pBuffer, int Size);
+	char *LoadData(int Index, int *pSize);
+	bool InflateData(int Index, const char *pMapped, int DataSize, char *pData, int Size);
+	char *TakePrefetched(int Index, int *pSize);
+	void WaitPrefetch(int Index);
+	static int PrefetchJob(void *pUser);
+	void CalculateHashes() const;
+	bool IsCachedData(int Index) const;
+	void EvictData(int KeepIndex);
 	void *GetDataImpl(int Index, int Swap);
-	int GetFileDataSize(int Index) const;
+	void *GetPublishedData(int Index, int Swap);
 	int GetFileItemSize(int Index) const;
 public:
-	CDataFileReader() : m_pDataFile(0) {}
+	enum
+	{
+		// map the file into memory, the items and uncompressed data are used in place
+		OPENFLAG_MMAP=1,
+		// don't hash the file until Sha256 or Crc is called for the first time
+		OPENFLAG_LAZY_HASH=2,
+		// load all data blocks while opening
+		OPENFLAG_PREFETCH=4,
+	};
+
+	// stages of an asynchronous open
+	enum
+	{
+		OPEN_PENDING=0,
+		OPEN_HEADER,
+		OPEN_ITEMS,
+		OPEN_HASHING,
+		OPEN_PREFETCH,
+		OPEN_DONE,
+		OPEN_FAILED,
+		OPEN_CANCELLED,
+	};
+
+	CDataFileReader() : m_pDataFile(0), m_pOpenJob(0), m_MemoryBudget(0) {}
 	~CDataFileReader() { Close(); }
 
-	bool IsOpen() const { return m_pDataFile != 0; }
+	bool IsOpen() const;
+
+	bool Open(class IStorage *pStorage, const char *pFilename, int StorageType, int Flags=0);
+	// uses the buffer in place like a mapped file, it has to outlive the reader. The items and
+	// uncompressed blocks point into it and can be modified, so it's always hashed while opening
+	bool OpenMemory(void *pData, unsigned Size, int Flags=0);
 
-	bool Open(class IStorage *pStorage, const char *pFilename, int StorageType);
+	// opens the file on the job pool, the reader must not be used until OpenStatus is OPEN_DONE.
+	// The storage and the pool must outlive the open, Close cancels and waits for it.
+	void OpenAsync(class CJobPool *pJobPool, class IStorage *pStorage, const char *pFilename, int StorageType, int Flags=0);
+	int OpenStatus() const;
+	float OpenProgress() const; // of the current stage
+	void CancelOpen();
+	bool WaitOpen();
 	bool Close();
 
 	void *GetData(int Index);
@@ -27,6 +89,32 @@ public:
 	int GetDataSize(int Index) const;
 	void ReplaceData(int Index, char *pData, int Size);
 	void UnloadData(int Index);
+
+	int GetDataCodec(int Index) const;
+	int GetFileDataSize(int Index) const; // bytes of the block in the file
+	// compressed bytes of a block as stored in the file, 0 for v3 files and replaced blocks
+	int GetRawDataSize(int Index) const;
+	// transformed blocks also report their codec and the size of the transformed data
+	bool ReadRawData(int Index, void *pBuffer, int BufferSize, int *pUncompressedSize, int *pCodec = 0, int *pEncodedSize = 0);
+
+	// loads and decompresses the given data blocks (all if pIndices is null) on the job pool,
+	// GetData picks them up once they are done. The pool must outlive the pending jobs.
+	void Prefetch(class CJobPool *pJobPool, const int *pIndices=0, int NumIndices=0);
+	// blocks until all prefetch jobs are done
+	void WaitPrefetch();
+
+	// limits the memory of loaded blocks, the least recently used unpinned blocks are unloaded
+	// and reloaded on their next access. 0 disables the limit, it's kept for the next open. Any
+	// GetData can unload blocks, so with a budget the reader must only be used by one thread
+	// and data pointers stay valid while the block is pinned or until the next GetData call.
+	void SetMemoryBudget(int64 Budget);
+	int64 MemoryUsage() const;
+	// the pins belong to the open file, closing it drops them
+	void PinData(int Index);
+	void UnpinData(int Index);
+	// tells the opened files apart, every open gets a new one. 0 if nothing is open
+	unsigned Serial() const;
+
 	void *GetItem(int Index, int *pType, int *pID);
 	int GetItemSize(int Index) const;
 	void GetType(int Type, int *pStart, int *pNum);
@@ -49,6 +137,12 @@ class CDataFileWriter
 		int m_UncompressedSize;
 		int m_CompressedSize;
 		void *m_pCompressedData;
+		void *m_pUncompressedData; // pending compression
+		int m_Compression;
+		int m_Codec;
+		int m_EncodedSize; // of the transformed data that gets compressed
+		bool m_Raw;
+		SHA256_DIGEST m_Hash; // of the uncompressed data, the compressed data for raw blocks
 	};
 
 	struct CItemInfo
@@ -63,33 +157,85 @@ class CDataFileWriter
 
 	struct CItemTypeInfo
 	{
+		int m_Type;
 		int m_Num;
 		int m_First;
 		int m_Last;
-	};
 
-	enum
-	{
-		MAX_ITEM_TYPES=0xffff,
-		MAX_ITEMS=1024,
-		MAX_DATAS=1024,
+		bool operator<(const CItemTypeInfo &Other) const { return m_Type < Other.m_Type; }
+		bool operator==(const CItemTypeInfo &Other) const { return m_Type == Other.m_Type; }
 	};
 
 	IOHANDLE m_File;
-	int m_NumItems;
-	int m_NumDatas;
-	int m_NumItemTypes;
-	CItemTypeInfo *m_pItemTypes;
-	CItemInfo *m_pItems;
-	CDataInfo *m_pDatas;
+	bool m_ToMemory;
+	char *m_pMemory;
+	unsigned m_MemorySize;
+	unsigned m_MemoryCapacity;
+	class CJobPool *m_pJobPool;
+	int m_Compression;
+	bool m_Dedup;
+	bool m_Streaming;
+	class IStorage *m_pStorage;
+	IOHANDLE m_SpillFile;
+	char m_aSpillFilename[IO_MAX_PATH_LENGTH];
+	int m_NumSpilled;
+	bool m_WriteFailed; // a short write of the file or the spilled data
+	sorted_array<CItemTypeInfo> m_ItemTypes; // only the used types, sorted by type
+	array<CItemInfo> m_Items;
+	array<CDataInfo> m_Datas;
+	array<int> m_DedupTable; // open addressing over m_Datas, -1 marks free slots
+
+	static void CompressData(CDataInfo *pInfo, const void *pData);
+	static int CompressJob(void *pUser);
+	int AddDataImpl(int Size, const void *pData, int Compression, int Codec);
+	int AddRawInfo(int UncompressedSize, int CompressedSize, void *pCompressedData, int Codec, int EncodedSize);
+	int FindDuplicate(const CDataInfo *pInfo) const;
+	int InsertData(const CDataInfo *pInfo);
+	void InsertDuplicateSlot(int Index);
+	void Reset(class CJobPool *pJobPool);
+	void SpillData();
+	void ReserveMemory(unsigned Size);
+	void Write(const void *pData, unsigned Size);
+	bool IsOpen() const { return m_File || m_ToMemory; }
 
 public:
+	enum
+	{
+		COMPRESSION_WRITER=-1, // use the policy of the writer
+		COMPRESSION_DEFAULT=0,
+		COMPRESSION_STORE, // no compression, still a valid zlib stream
+		COMPRESSION_FAST,
+		COMPRESSION_MAX,
+		COMPRESSION_AUTO, // store blocks that do not compress, default level for the rest
+	};
+
 	CDataFileWriter();
 	~CDataFileWriter();
-	bool Open(class IStorage *pStorage, const char *Filename);
-	int AddData(int Size, const void *pData);
-	int AddDataSwapped(int Size, const void *pData);
+	// with a job pool, AddData only records the blocks and Flush/Finish compress them in parallel
+	bool Open(class IStorage *pStorage, const char *Filename, class CJobPool *pJobPool = 0);
+	// writes the datafile into a memory buffer, take it with ReleaseMemory after Finish
+	bool OpenMemory(class CJobPool *pJobPool = 0);
+	void *ReleaseMemory(unsigned *pSize); // free it with mem_free
+	void SetCompression(int Compression) { m_Compression = Compression; }
+	// identical blocks added later return the index of the first one. Only the blocks added
+	// with it are hashed, so it has to be set before the first block
+	void SetDeduplicate(bool Dedup) { dbg_assert(!m_Datas.size(), "data was already added"); m_Dedup = Dedup; }
+	// compressed blocks are moved to a temporary file right away instead of being kept until Finish,
+	// with a job pool that happens on Flush. Takes effect with the next file Open
+	void SetStreaming(bool Streaming) { m_Streaming = Streaming; }
+	int AddData(int Size, const void *pData, int Compression = COMPRESSION_WRITER);
+	int AddDataSwapped(int Size, const void *pData, int Compression = COMPRESSION_WRITER);
+	// tile data gets split into runs and byte planes before compressing it, needs a v5 reader
+	int AddTileData(int Size, const void *pData, int Compression = COMPRESSION_WRITER);
+	// adds an already compressed block, the bytes are written as they are. EncodedSize is
+	// the size of the transformed data and only used with a codec
+	int AddDataRaw(int UncompressedSize, int CompressedSize, const void *pCompressedData, int Codec = DATACODEC_NONE, int EncodedSize = 0);
+	// copies a block from another datafile without recompressing it when possible,
+	// -1 if the block can't be read
+	int AddDataFrom(CDataFileReader *pReader, int Index);
 	int AddItem(int Type, int ID, int Size, const void *pData);
+	void Flush();
+	// 0 if the file couldn't be written completely
 	int Finish();
 };
 
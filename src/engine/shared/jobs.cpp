@@ -29,9 +29,25 @@ void CJobPool::Shutdown()
 		thread_wait(m_apThreads[i]);
 		thread_destroy(m_apThreads[i]);
 	}
+
+	// finish the jobs that are left, someone might wait for them
+	while(m_pFirstJob)
+	{
+		CJob *pJob = m_pFirstJob;
+		m_pFirstJob = pJob->m_pNext;
+		RunJob(pJob);
+	}
+	m_pLastJob = 0;
 	lock_destroy(m_Lock);
 }
 
+void CJobPool::RunJob(CJob *pJob)
+{
+	pJob->m_Status = CJob::STATE_RUNNING;
+	pJob->m_Result = pJob->m_pfnFunc(pJob->m_pFuncData);
+	pJob->m_Status = CJob::STATE_DONE;
+}
+
 void CJobPool::WorkerThread(void *pUser)
 {
 	CJobPool *pPool = (CJobPool *)pUser;
@@ -55,11 +71,7 @@ void CJobPool::WorkerThread(void *pUser)
 
 		// do the job if we have one
 		if(pJob)
-		{
-			pJob->m_Status = CJob::STATE_RUNNING;
-			pJob->m_Result = pJob->m_pfnFunc(pJob->m_pFuncData);
-			pJob->m_Status = CJob::STATE_DONE;
-		}
+			RunJob(pJob);
 		else
 			thread_sleep(10);
 	}
@@ -81,6 +93,13 @@ int CJobPool::Add(CJob *pJob, JOBFUNC pfnFunc, void *pData)
 	pJob->m_pfnFunc = pfnFunc;
 	pJob->m_pFuncData = pData;
 
+	// nobody would pick it up
+	if(!m_NumThreads || m_Shutdown)
+	{
+		RunJob(pJob);
+		return 0;
+	}
+
 	lock_wait(m_Lock);
 
 	// add job to queue
@@ -51,13 +51,16 @@ class CJobPool
 	CJob *m_pLastJob;
 
 	static void WorkerThread(void *pUser);
+	static void RunJob(CJob *pJob);
 
 public:
 	CJobPool();
 	~CJobPool();
 
 	int Init(int NumThreads);
+	// the jobs that are still queued run on the calling thread
 	void Shutdown();
+	// without threads or after Shutdown the job runs right away
 	int Add(CJob *pJob, JOBFUNC pfnFunc, void *pData);
 };
 #endif
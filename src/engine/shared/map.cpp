@@ -15,7 +15,11 @@ public:
 	virtual void *GetData(int Index) { return m_DataFile.GetData(Index); }
 	virtual void *GetDataSwapped(int Index) { return m_DataFile.GetDataSwapped(Index); }
 	virtual void UnloadData(int Index) { m_DataFile.UnloadData(Index); }
+	virtual void PinData(int Index) { m_DataFile.PinData(Index); }
+	virtual void UnpinData(int Index) { m_DataFile.UnpinData(Index); }
+	virtual unsigned Serial() { return m_DataFile.Serial(); }
 	virtual void *GetItem(int Index, int *pType, int *pID) { return m_DataFile.GetItem(Index, pType, pID); }
+	virtual int GetItemSize(int Index) { return m_DataFile.GetItemSize(Index); }
 	virtual void GetType(int Type, int *pStart, int *pNum) { m_DataFile.GetType(Type, pStart, pNum); }
 	virtual void *FindItem(int Type, int ID) { return m_DataFile.FindItem(Type, ID); }
 	virtual int NumItems() { return m_DataFile.NumItems(); }
@@ -30,6 +34,36 @@ public:
 		return m_DataFile.Open(pStorage, pMapName, IStorage::TYPE_ALL);
 	}
 
+	virtual void LoadAsync(const char *pMapName, CJobPool *pJobPool, IStorage *pStorage)
+	{
+		m_DataFile.OpenAsync(pJobPool, pStorage, pMapName, IStorage::TYPE_ALL, CDataFileReader::OPENFLAG_PREFETCH);
+	}
+
+	virtual int LoadStatus()
+	{
+		switch(m_DataFile.OpenStatus())
+		{
+		case CDataFileReader::OPEN_PENDING: return LOAD_PENDING;
+		case CDataFileReader::OPEN_HEADER: return LOAD_HEADER;
+		case CDataFileReader::OPEN_ITEMS: return LOAD_ITEMS;
+		case CDataFileReader::OPEN_HASHING: return LOAD_HASHING;
+		case CDataFileReader::OPEN_PREFETCH: return LOAD_PREFETCH;
+		case CDataFileReader::OPEN_DONE: return LOAD_DONE;
+		case CDataFileReader::OPEN_CANCELLED: return LOAD_CANCELLED;
+		}
+		return LOAD_FAILED;
+	}
+
+	virtual float LoadProgress()
+	{
+		return m_DataFile.OpenProgress();
+	}
+
+	virtual void CancelLoad()
+	{
+		m_DataFile.CancelOpen();
+	}
+
 	virtual bool IsLoaded()
 	{
 		return m_DataFile.IsOpen();
@@ -44,6 +78,16 @@ public:
 	{
 		return m_DataFile.Crc();
 	}
+
+	virtual void Prefetch(CJobPool *pJobPool)
+	{
+		m_DataFile.Prefetch(pJobPool);
+	}
+
+	virtual void SetMemoryBudget(int64 Budget)
+	{
+		m_DataFile.SetMemoryBudget(Budget);
+	}
 };
 
 extern IEngineMap *CreateEngineMap() { return new CMap; }
@@ -3,21 +3,38 @@
 #include <base/system.h>
 #include <base/math.h>
 #include <base/vmath.h>
+#include <base/tl/threading.h>
 
 #include <math.h>
 #include <engine/map.h>
 #include <engine/kernel.h>
+#include <engine/shared/jobs.h>
 
 #include <game/mapitems.h>
 #include <game/layers.h>
 #include <game/collision.h>
 
+#if defined(CONF_SSE2)
+#include <emmintrin.h>
+#endif
+
 CCollision::CCollision()
 {
-	m_pTiles = 0;
+	m_pFlags = 0;
 	m_Width = 0;
 	m_Height = 0;
 	m_pLayers = 0;
+	m_pDistances = 0;
+	m_pRowDistances = 0;
+	m_pRowValid = 0;
+	m_pBandValid = 0;
+	m_pJobPool = 0;
+}
+
+CCollision::~CCollision()
+{
+	mem_free(m_pFlags);
+	mem_free(m_pDistances);
 }
 
 void CCollision::Init(class CLayers *pLayers)
@@ -25,38 +42,198 @@ void CCollision::Init(class CLayers *pLayers)
 	m_pLayers = pLayers;
 	m_Width = m_pLayers->GameLayer()->m_Width;
 	m_Height = m_pLayers->GameLayer()->m_Height;
-	m_pTiles = static_cast<CTile *>(m_pLayers->Map()->GetData(m_pLayers->GameLayer()->m_Data));
+	const CTile *pTiles = m_pLayers->GetTiles(m_pLayers->GameLayerIndex());
 
+	// the flags are kept apart, the map data stays as it is for everyone else
+	mem_free(m_pFlags);
+	m_pFlags = (unsigned char *)mem_alloc(m_Width*m_Height);
 	for(int i = 0; i < m_Width*m_Height; i++)
 	{
-		int Index = m_pTiles[i].m_Index;
-
-		if(Index > 128)
-			continue;
-
-		switch(Index)
+		switch(pTiles[i].m_Index)
 		{
 		case TILE_DEATH:
-			m_pTiles[i].m_Index = COLFLAG_DEATH;
+			m_pFlags[i] = COLFLAG_DEATH;
 			break;
 		case TILE_SOLID:
-			m_pTiles[i].m_Index = COLFLAG_SOLID;
+			m_pFlags[i] = COLFLAG_SOLID;
 			break;
 		case TILE_NOHOOK:
-			m_pTiles[i].m_Index = COLFLAG_SOLID|COLFLAG_NOHOOK;
+			m_pFlags[i] = COLFLAG_SOLID|COLFLAG_NOHOOK;
 			break;
 		default:
-			m_pTiles[i].m_Index = 0;
+			m_pFlags[i] = 0;
 		}
 	}
+
+	if(m_pDistances)
+		InitDistanceField(m_pJobPool);
 }
 
-int CCollision::GetTile(int x, int y) const
+struct CCollisionDistanceJob
+{
+	CJob m_Job;
+	volatile unsigned m_Claimed;
+	const CCollision *m_pCollision;
+	int m_Band;
+	bool m_Rows; // the distances within the rows of the band, or of the band itself
+};
+
+void CCollision::InitDistanceField(CJobPool *pJobPool)
 {
-	int Nx = clamp(x/32, 0, m_Width-1);
-	int Ny = clamp(y/32, 0, m_Height-1);
+	dbg_assert(m_pFlags != 0, "the distance field needs the game layer");
+
+	// one block for everything, nothing is computed until it's used
+	const int NumBands = (m_Height+DISTANCE_BAND-1)/DISTANCE_BAND;
+	mem_free(m_pDistances);
+	m_pDistances = (unsigned char *)mem_alloc(2*m_Width*m_Height+m_Height+NumBands);
+	m_pRowDistances = m_pDistances+m_Width*m_Height;
+	m_pRowValid = m_pRowDistances+m_Width*m_Height;
+	m_pBandValid = m_pRowValid+m_Height;
+	mem_zero(m_pRowValid, m_Height+NumBands);
+	m_pJobPool = pJobPool;
+}
+
+int CCollision::GetDistance(int TileX, int TileY) const
+{
+	return m_pDistances ? GetDistanceAt(TileX, TileY) : 0;
+}
+
+void CCollision::SetTile(int TileX, int TileY, int Flags)
+{
+	if(TileX < 0 || TileX >= m_Width || TileY < 0 || TileY >= m_Height)
+		return;
+	m_pFlags[TileY*m_Width+TileX] = Flags;
+	if(!m_pDistances)
+		return;
+
+	// only tiles closer than MAX_DISTANCE can see the change
+	m_pRowValid[TileY] = 0;
+	const int FirstBand = maximum(TileY-MAX_DISTANCE, 0)/DISTANCE_BAND;
+	const int LastBand = minimum(TileY+MAX_DISTANCE, m_Height-1)/DISTANCE_BAND;
+	for(int b = FirstBand; b <= LastBand; b++)
+		m_pBandValid[b] = 0;
+}
 
-	return m_pTiles[Ny*m_Width+Nx].m_Index > 128 ? 0 : m_pTiles[Ny*m_Width+Nx].m_Index;
+int CCollision::GetDistanceAt(int TileX, int TileY) const
+{
+	int Nx = clamp(TileX, 0, m_Width-1);
+	int Ny = clamp(TileY, 0, m_Height-1);
+
+	if(!m_pBandValid[Ny/DISTANCE_BAND])
+		UpdateDistances();
+	return m_pDistances[Ny*m_Width+Nx];
+}
+
+void CCollision::UpdateRow(int y) const
+{
+	// nearest solid tile on the left, then on the right
+	const unsigned char *pFlags = m_pFlags+y*m_Width;
+	unsigned char *pRow = m_pRowDistances+y*m_Width;
+	int Distance = MAX_DISTANCE;
+	for(int x = 0; x < m_Width; x++)
+	{
+		Distance = pFlags[x]&COLFLAG_SOLID ? 0 : minimum(Distance+1, (int)MAX_DISTANCE);
+		pRow[x] = Distance;
+	}
+	Distance = MAX_DISTANCE;
+	for(int x = m_Width-1; x >= 0; x--)
+	{
+		Distance = pFlags[x]&COLFLAG_SOLID ? 0 : minimum(Distance+1, (int)MAX_DISTANCE);
+		pRow[x] = minimum((int)pRow[x], Distance);
+	}
+	m_pRowValid[y] = 1;
+}
+
+void CCollision::UpdateBand(int Band) const
+{
+	// the chebyshev distance, the nearest solid tile of the rows above and below
+	// counts with the larger of both offsets
+	const int End = minimum((Band+1)*DISTANCE_BAND, m_Height);
+	for(int y = Band*DISTANCE_BAND; y < End; y++)
+	{
+		for(int x = 0; x < m_Width; x++)
+		{
+			int Distance = m_pRowDistances[y*m_Width+x];
+			for(int k = 1; k < Distance; k++)
+			{
+				if(y-k >= 0)
+					Distance = minimum(Distance, maximum(k, (int)m_pRowDistances[(y-k)*m_Width+x]));
+				if(y+k < m_Height)
+					Distance = minimum(Distance, maximum(k, (int)m_pRowDistances[(y+k)*m_Width+x]));
+			}
+			m_pDistances[y*m_Width+x] = Distance;
+		}
+	}
+	m_pBandValid[Band] = 1;
+}
+
+int CCollision::DistanceJob(void *pUser)
+{
+	CCollisionDistanceJob *pJob = static_cast<CCollisionDistanceJob *>(pUser);
+	if(atomic_compswap(&pJob->m_Claimed, 0, 1) == 0)
+	{
+		const CCollision *pCollision = pJob->m_pCollision;
+		if(pJob->m_Rows)
+		{
+			const int End = minimum((pJob->m_Band+1)*DISTANCE_BAND, pCollision->m_Height);
+			for(int y = pJob->m_Band*DISTANCE_BAND; y < End; y++)
+			{
+				if(!pCollision->m_pRowValid[y])
+					pCollision->UpdateRow(y);
+			}
+		}
+		else
+			pCollision->UpdateBand(pJob->m_Band);
+	}
+	return 0;
+}
+
+void CCollision::UpdateDistances() const
+{
+	const int NumBands = (m_Height+DISTANCE_BAND-1)/DISTANCE_BAND;
+	CCollisionDistanceJob *pJobs = new CCollisionDistanceJob[NumBands];
+
+	// the rows of all changed bands first, a band needs the rows around it
+	for(int Pass = 0; Pass < 2; Pass++)
+	{
+		int NumJobs = 0;
+		for(int b = 0; b < NumBands; b++)
+		{
+			if(m_pBandValid[b])
+				continue;
+			pJobs[NumJobs].m_Claimed = 0;
+			pJobs[NumJobs].m_pCollision = this;
+			pJobs[NumJobs].m_Band = b;
+			pJobs[NumJobs].m_Rows = Pass == 0;
+			if(m_pJobPool)
+				m_pJobPool->Add(&pJobs[NumJobs].m_Job, DistanceJob, &pJobs[NumJobs]);
+			NumJobs++;
+		}
+
+		// help out from the back of the queue, then wait for the workers
+		for(int j = NumJobs-1; j >= 0; j--)
+			DistanceJob(&pJobs[j]);
+		for(int j = 0; j < NumJobs; j++)
+		{
+			while(pJobs[j].m_Job.Status() != CJob::STATE_DONE)
+				thread_yield();
+		}
+		sync_barrier();
+	}
+	delete[] pJobs;
+}
+
+int CCollision::GetTileAt(int TileX, int TileY) const
+{
+	int Nx = clamp(TileX, 0, m_Width-1);
+	int Ny = clamp(TileY, 0, m_Height-1);
+
+	return m_pFlags[Ny*m_Width+Nx];
+}
+
+int CCollision::GetTile(int x, int y) const
+{
+	return GetTileAt(x/32, y/32);
 }
 
 bool CCollision::IsTile(int x, int y, int Flag) const
@@ -64,14 +241,193 @@ bool CCollision::IsTile(int x, int y, int Flag) const
 	return GetTile(x, y)&Flag;
 }
 
-// TODO: rewrite this smarter!
+#if defined(CONF_SSE2)
+// tile columns or rows of four positions, rounded like CheckPoint does and clamped to the map
+static __m128i TileCoords(__m128 Pos, __m128i Max)
+{
+	const __m128 Half = _mm_or_ps(_mm_set1_ps(0.5f), _mm_and_ps(Pos, _mm_set1_ps(-0.0f)));
+	__m128i Tile = _mm_srai_epi32(_mm_cvttps_epi32(_mm_add_ps(Pos, Half)), 5);
+	Tile = _mm_andnot_si128(_mm_cmplt_epi32(Tile, _mm_setzero_si128()), Tile);
+	const __m128i Over = _mm_cmpgt_epi32(Tile, Max);
+	return _mm_or_si128(_mm_and_si128(Over, Max), _mm_andnot_si128(Over, Tile));
+}
+
+// sse2 has no 32 bit multiply, the products fit as the map has less than 2^31 tiles
+static __m128i MulLo(__m128i A, __m128i B)
+{
+	const __m128i Even = _mm_mul_epu32(A, B);
+	const __m128i Odd = _mm_mul_epu32(_mm_srli_si128(A, 4), _mm_srli_si128(B, 4));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(Even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(Odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+void CCollision::GetCollisionsAt(const float *pX, const float *pY, int Num, unsigned char *pFlags) const
+{
+	int i = 0;
+#if defined(CONF_SSE2)
+	const __m128i MaxX = _mm_set1_epi32(m_Width-1);
+	const __m128i MaxY = _mm_set1_epi32(m_Height-1);
+	const __m128i Width = _mm_set1_epi32(m_Width);
+	for(; i+4 <= Num; i += 4)
+	{
+		int aIndices[4];
+		__m128i TileX = TileCoords(_mm_loadu_ps(pX+i), MaxX);
+		__m128i TileY = TileCoords(_mm_loadu_ps(pY+i), MaxY);
+		_mm_storeu_si128((__m128i *)aIndices, _mm_add_epi32(MulLo(TileY, Width), TileX));
+		pFlags[i] = m_pFlags[aIndices[0]];
+		pFlags[i+1] = m_pFlags[aIndices[1]];
+		pFlags[i+2] = m_pFlags[aIndices[2]];
+		pFlags[i+3] = m_pFlags[aIndices[3]];
+	}
+#endif
+	for(; i < Num; i++)
+		pFlags[i] = GetCollisionAt(pX[i], pY[i]);
+}
+
+void CCollision::TestBoxes(const float *pX, const float *pY, int Num, vec2 Size, unsigned char *pFlags) const
+{
+	Size *= 0.5f;
+	int i = 0;
+#if defined(CONF_SSE2)
+	const __m128i MaxX = _mm_set1_epi32(m_Width-1);
+	const __m128i MaxY = _mm_set1_epi32(m_Height-1);
+	const __m128i Width = _mm_set1_epi32(m_Width);
+	const __m128 HalfX = _mm_set1_ps(Size.x);
+	const __m128 HalfY = _mm_set1_ps(Size.y);
+	for(; i+4 <= Num; i += 4)
+	{
+		// the corners share their columns and rows
+		int aIndices[4][4];
+		const __m128 X = _mm_loadu_ps(pX+i);
+		const __m128 Y = _mm_loadu_ps(pY+i);
+		const __m128i Left = TileCoords(_mm_sub_ps(X, HalfX), MaxX);
+		const __m128i Right = TileCoords(_mm_add_ps(X, HalfX), MaxX);
+		const __m128i Top = MulLo(TileCoords(_mm_sub_ps(Y, HalfY), MaxY), Width);
+		const __m128i Bottom = MulLo(TileCoords(_mm_add_ps(Y, HalfY), MaxY), Width);
+		_mm_storeu_si128((__m128i *)aIndices[0], _mm_add_epi32(Top, Left));
+		_mm_storeu_si128((__m128i *)aIndices[1], _mm_add_epi32(Top, Right));
+		_mm_storeu_si128((__m128i *)aIndices[2], _mm_add_epi32(Bottom, Left));
+		_mm_storeu_si128((__m128i *)aIndices[3], _mm_add_epi32(Bottom, Right));
+		for(int k = 0; k < 4; k++)
+			pFlags[i+k] = m_pFlags[aIndices[0][k]]|m_pFlags[aIndices[1][k]]|m_pFlags[aIndices[2][k]]|m_pFlags[aIndices[3][k]];
+	}
+#endif
+	for(; i < Num; i++)
+	{
+		pFlags[i] = GetCollisionAt(pX[i]-Size.x, pY[i]-Size.y)|GetCollisionAt(pX[i]+Size.x, pY[i]-Size.y)|
+			GetCollisionAt(pX[i]-Size.x, pY[i]+Size.y)|GetCollisionAt(pX[i]+Size.x, pY[i]+Size.y);
+	}
+}
+
+// walks the tiles a segment crosses in order. Points belong to the tile CheckPoint
+// rounds them into, so tile k covers [32k-0.5, 32k+31.5) on each axis
+struct CTileWalk
+{
+	vec2 m_Start;
+	vec2 m_Delta;
+	int m_StepX;
+	int m_StepY;
+	float m_DeltaX; // segment parameter between two boundaries
+	float m_DeltaY;
+
+	int m_TileX;
+	int m_TileY;
+	float m_NextX; // segment parameter of the next boundary
+	float m_NextY;
+	float m_Enter; // of the current tile
+	int m_Steps; // tiles left to the end
+
+	CTileWalk(vec2 Pos0, vec2 Pos1)
+	{
+		m_Start = (Pos0+vec2(0.5f, 0.5f))/32.0f;
+		m_Delta = (Pos1-Pos0)/32.0f;
+		m_StepX = m_Delta.x < 0 ? -1 : 1;
+		m_StepY = m_Delta.y < 0 ? -1 : 1;
+		m_DeltaX = m_Delta.x != 0 ? m_StepX/m_Delta.x : 0.0f;
+		m_DeltaY = m_Delta.y != 0 ? m_StepY/m_Delta.y : 0.0f;
+		Seek(0.0f);
+	}
+
+	// continues the walk at the given segment parameter
+	void Seek(float t)
+	{
+		const vec2 Pos = m_Start+m_Delta*t;
+		m_TileX = (int)floorf(Pos.x);
+		m_TileY = (int)floorf(Pos.y);
+		m_NextX = m_Delta.x != 0 ? (m_TileX+(m_StepX > 0)-m_Start.x)/m_Delta.x : 2.0f;
+		m_NextY = m_Delta.y != 0 ? (m_TileY+(m_StepY > 0)-m_Start.y)/m_Delta.y : 2.0f;
+		m_Enter = t;
+		m_Steps = absolute((int)floorf(m_Start.x+m_Delta.x)-m_TileX) + absolute((int)floorf(m_Start.y+m_Delta.y)-m_TileY);
+	}
+
+	float Exit() const { return minimum(minimum(m_NextX, m_NextY), 1.0f); }
+
+	// false at the end of the segment
+	bool Step()
+	{
+		if(m_Steps-- <= 0)
+			return false;
+		if(m_NextX < m_NextY)
+		{
+			m_Enter = m_NextX;
+			m_NextX += m_DeltaX;
+			m_TileX += m_StepX;
+		}
+		else
+		{
+			m_Enter = m_NextY;
+			m_NextY += m_DeltaY;
+			m_TileY += m_StepY;
+		}
+		return true;
+	}
+};
+
 int CCollision::IntersectLine(vec2 Pos0, vec2 Pos1, vec2 *pOutCollision, vec2 *pOutBeforeCollision) const
 {
+	CTileWalk Walk(Pos0, Pos1);
+	const float Length = distance(Pos0, Pos1);
+	for(;;)
+	{
+		int Tile = GetTileAt(Walk.m_TileX, Walk.m_TileY);
+		if(Tile&COLFLAG_SOLID)
+			return HitLine(Pos0, Pos1, Walk.m_Enter, Walk.Exit(), Tile, pOutCollision, pOutBeforeCollision);
+
+		if(m_pDistances)
+		{
+			// nothing solid within Distance-1 tiles around this one, jump to a pixel before that
+			const int Distance = GetDistanceAt(Walk.m_TileX, Walk.m_TileY);
+			if(Distance > 2)
+			{
+				const float Jump = Walk.m_Enter+((Distance-1)*32.0f-1.0f)/Length;
+				if(Jump >= 1.0f)
+					break;
+				Walk.Seek(Jump);
+				continue;
+			}
+		}
+
+		if(!Walk.Step())
+			break;
+	}
+
+	if(pOutCollision)
+		*pOutCollision = Pos1;
+	if(pOutBeforeCollision)
+		*pOutBeforeCollision = Pos1;
+	return 0;
+}
+
+int CCollision::HitLine(vec2 Pos0, vec2 Pos1, float Enter, float Exit, int Tile, vec2 *pOutCollision, vec2 *pOutBeforeCollision) const
+{
+	// report the positions of the old one sample per pixel walk, only the samples within
+	// the hit tile are checked
 	const int End = distance(Pos0, Pos1)+1;
 	const float InverseEnd = 1.0f/End;
-	vec2 Last = Pos0;
+	const int First = (int)(Enter*End);
+	const int Last = minimum((int)(Exit*End), End);
 
-	for(int i = 0; i <= End; i++)
+	for(int i = First; i <= Last; i++)
 	{
 		vec2 Pos = mix(Pos0, Pos1, i*InverseEnd);
 		if(CheckPoint(Pos.x, Pos.y))
@@ -79,16 +435,17 @@ int CCollision::IntersectLine(vec2 Pos0, vec2 Pos1, vec2 *pOutCollision, vec2 *p
 			if(pOutCollision)
 				*pOutCollision = Pos;
 			if(pOutBeforeCollision)
-				*pOutBeforeCollision = Last;
+				*pOutBeforeCollision = i > 0 ? mix(Pos0, Pos1, (i-1)*InverseEnd) : Pos0;
 			return GetCollisionAt(Pos.x, Pos.y);
 		}
-		Last = Pos;
 	}
+
+	// the segment only cuts a corner of the tile, between two samples
 	if(pOutCollision)
-		*pOutCollision = Pos1;
+		*pOutCollision = mix(Pos0, Pos1, Enter);
 	if(pOutBeforeCollision)
-		*pOutBeforeCollision = Pos1;
-	return 0;
+		*pOutBeforeCollision = mix(Pos0, Pos1, First*InverseEnd);
+	return Tile;
 }
 
 // TODO: OPT: rewrite this smarter!
@@ -144,6 +501,63 @@ bool CCollision::TestBox(vec2 Pos, vec2 Size, int Flag) const
 	return false;
 }
 
+// steps of the given size a coordinate can take before it reaches the next tile
+static int StepsInTile(float Pos, float Step, int NumTiles, int Max)
+{
+	if(Step == 0.0f)
+		return Max;
+
+	// tile k covers [32k-0.5, 32k+31.5) after the rounding in CheckPoint, outside tiles are clamped
+	const int Tile = clamp((int)floorf((Pos+0.5f)/32.0f), 0, NumTiles-1);
+	float Dist;
+	if(Step > 0.0f)
+	{
+		if(Tile == NumTiles-1)
+			return Max;
+		Dist = (Tile+1)*32.0f-0.5f-Pos;
+	}
+	else
+	{
+		if(Tile == 0)
+			return Max;
+		Dist = Pos-(Tile*32.0f-0.5f);
+	}
+
+	// keep a step away from the boundary, the positions pick up rounding errors
+	const float Steps = Dist/absolute(Step)-1.0f;
+	return Steps < Max ? maximum((int)Steps, 0) : Max;
+}
+
+int CCollision::StepsInTiles(vec2 Pos, vec2 Step, vec2 Size, bool Death, int Max) const
+{
+	// the corners TestBox checks, of the death box too while it matters
+	const vec2 aHalfSizes[2] = {Size*0.5f, Size*(2.0f/3.0f)*0.5f};
+	for(int i = 0; i < (Death ? 2 : 1); i++)
+	{
+		Max = StepsInTile(Pos.x-aHalfSizes[i].x, Step.x, m_Width, Max);
+		Max = StepsInTile(Pos.x+aHalfSizes[i].x, Step.x, m_Width, Max);
+		Max = StepsInTile(Pos.y-aHalfSizes[i].y, Step.y, m_Height, Max);
+		Max = StepsInTile(Pos.y+aHalfSizes[i].y, Step.y, m_Height, Max);
+	}
+	return Max;
+}
+
+int CCollision::StepsInFreeSpace(vec2 Pos, vec2 Step, vec2 Size, int Max) const
+{
+	// the corners can move a pixel less than the distance to the nearest solid tile
+	const vec2 Half = Size*0.5f;
+	int Distance = MAX_DISTANCE;
+	Distance = minimum(Distance, GetDistanceAt(round_to_int(Pos.x-Half.x)/32, round_to_int(Pos.y-Half.y)/32));
+	Distance = minimum(Distance, GetDistanceAt(round_to_int(Pos.x+Half.x)/32, round_to_int(Pos.y-Half.y)/32));
+	Distance = minimum(Distance, GetDistanceAt(round_to_int(Pos.x-Half.x)/32, round_to_int(Pos.y+Half.y)/32));
+	Distance = minimum(Distance, GetDistanceAt(round_to_int(Pos.x+Half.x)/32, round_to_int(Pos.y+Half.y)/32));
+	if(Distance <= 1)
+		return 0;
+
+	const float Steps = ((Distance-1)*32.0f-1.0f)/length(Step);
+	return Steps < Max ? (int)Steps : Max;
+}
+
 void CCollision::MoveBox(vec2 *pInoutPos, vec2 *pInoutVel, vec2 Size, float Elasticity, bool *pDeath) const
 {
 	// do the move
@@ -161,7 +575,8 @@ void CCollision::MoveBox(vec2 *pInoutPos, vec2 *pInoutVel, vec2 Size, float Elas
 		const float Fraction = 1.0f/(Max+1);
 		for(int i = 0; i <= Max; i++)
 		{
-			vec2 NewPos = Pos + Vel*Fraction; // TODO: this row is not nice
+			const vec2 Step = Vel*Fraction;
+			vec2 NewPos = Pos + Step; // TODO: this row is not nice
 
 			//You hit a deathtile, congrats to that :)
 			//Deathtiles are a bit smaller
@@ -198,6 +613,18 @@ void CCollision::MoveBox(vec2 *pInoutPos, vec2 *pInoutVel, vec2 Size, float Elas
 					Vel.x *= -Elasticity;
 				}
 			}
+			else
+			{
+				// nothing changes until a corner of the box reaches the next tile
+				const bool Death = pDeath && !*pDeath;
+				int Skip = StepsInTiles(NewPos, Step, Size, Death, Max-i);
+				if(m_pDistances && !Death)
+					Skip = maximum(Skip, StepsInFreeSpace(NewPos, Step, Size, Max-i));
+				// the steps are still added one by one, so the rounding is the same as without skipping
+				for(int k = 0; k < Skip; k++)
+					NewPos += Step;
+				i += Skip;
+			}
 
 			Pos = NewPos;
 		}
@@ -7,13 +7,35 @@
 
 class CCollision
 {
-	struct CTile *m_pTiles;
+	unsigned char *m_pFlags; // COLFLAG_* per tile
 	int m_Width;
 	int m_Height;
 	class CLayers *m_pLayers;
 
+	enum
+	{
+		DISTANCE_BAND=16, // rows that are rebuilt together
+	};
+
+	// distance field, built on first use after a change per band of rows. It's computed from the
+	// distances within each row, the bands need the rows around them
+	unsigned char *m_pDistances;
+	unsigned char *m_pRowDistances;
+	unsigned char *m_pRowValid;
+	unsigned char *m_pBandValid;
+	class CJobPool *m_pJobPool;
+
 	bool IsTile(int x, int y, int Flag=COLFLAG_SOLID) const;
 	int GetTile(int x, int y) const;
+	int GetTileAt(int TileX, int TileY) const;
+	int StepsInTiles(vec2 Pos, vec2 Step, vec2 Size, bool Death, int Max) const;
+	int StepsInFreeSpace(vec2 Pos, vec2 Step, vec2 Size, int Max) const;
+	int GetDistanceAt(int TileX, int TileY) const;
+	void UpdateDistances() const;
+	void UpdateRow(int y) const;
+	void UpdateBand(int Band) const;
+	static int DistanceJob(void *pUser);
+	int HitLine(vec2 Pos0, vec2 Pos1, float Enter, float Exit, int Tile, vec2 *pOutCollision, vec2 *pOutBeforeCollision) const;
 
 public:
 	enum
@@ -21,9 +43,12 @@ public:
 		COLFLAG_SOLID=1,
 		COLFLAG_DEATH=2,
 		COLFLAG_NOHOOK=4,
+
+		MAX_DISTANCE=32,
 	};
 
 	CCollision();
+	~CCollision();
 	void Init(class CLayers *pLayers);
 	bool CheckPoint(float x, float y, int Flag=COLFLAG_SOLID) const { return IsTile(round_to_int(x), round_to_int(y), Flag); }
 	bool CheckPoint(vec2 Pos, int Flag=COLFLAG_SOLID) const { return CheckPoint(Pos.x, Pos.y, Flag); }
@@ -34,6 +59,20 @@ public:
 	void MovePoint(vec2 *pInoutPos, vec2 *pInoutVel, float Elasticity, int *pBounces) const;
 	void MoveBox(vec2 *pInoutPos, vec2 *pInoutVel, vec2 Size, float Elasticity, bool *pDeath=0) const;
 	bool TestBox(vec2 Pos, vec2 Size, int Flag=COLFLAG_SOLID) const;
+
+	// batched GetCollisionAt and TestBox on separate x and y arrays, pFlags receives the
+	// COLFLAG_* of each point or of all corners of each box
+	void GetCollisionsAt(const float *pX, const float *pY, int Num, unsigned char *pFlags) const;
+	void TestBoxes(const float *pX, const float *pY, int Num, vec2 Size, unsigned char *pFlags) const;
+
+	// keeps the distance to the nearest solid tile, IntersectLine and MoveBox then jump through
+	// free space. It's built lazily, on the job pool if given, so the queries must not run
+	// concurrently. Needs Init first and is kept over the next Init
+	void InitDistanceField(class CJobPool *pJobPool=0);
+	// in tiles and capped at MAX_DISTANCE, 0 without a distance field
+	int GetDistance(int TileX, int TileY) const;
+	// changes the COLFLAG_* of a tile, the distance field around it is rebuilt on its next use
+	void SetTile(int TileX, int TileY, int Flags);
 };
 
 #endif
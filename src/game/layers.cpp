@@ -1,104 +1,247 @@
 /* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
 /* If you are missing that file, acquire a complete release at teeworlds.com.                */
+#include <base/math.h>
+#include <base/tl/threading.h>
+#include <engine/shared/jobs.h>
+
 #include "layers.h"
 
+#if defined(CONF_SSE2)
+#include <emmintrin.h>
+#endif
+
+struct CLayerTiles
+{
+	enum
+	{
+		STATE_NONE=0,
+		STATE_BUSY,
+		STATE_DONE,
+	};
+
+	CJob m_Job;
+	CLayers *m_pLayers;
+	int m_Index;
+	volatile unsigned m_State;
+	CTile *m_pTiles;
+	int m_Data; // the pinned data block, -1 if none
+};
+
 CLayers::CLayers()
 {
-	m_GroupsNum = 0;
-	m_GroupsStart = 0;
-	m_LayersNum = 0;
-	m_LayersStart = 0;
 	m_pGameGroup = 0;
 	m_pGameLayer = 0;
+	m_GameLayerIndex = -1;
 	m_pMap = 0;
+	m_MapSerial = 0;
+	m_pLayerTiles = 0;
+}
+
+CLayers::~CLayers()
+{
+	ClearTiles();
 }
 
 void CLayers::Init(class IKernel *pKernel, IMap *pMap)
 {
+	ClearTiles();
 	m_pMap = pMap ? pMap : pKernel->RequestInterface<IMap>();
-	m_pMap->GetType(MAPITEMTYPE_GROUP, &m_GroupsStart, &m_GroupsNum);
-	m_pMap->GetType(MAPITEMTYPE_LAYER, &m_LayersStart, &m_LayersNum);
+	m_MapSerial = m_pMap->Serial();
+	m_Groups.Init(m_pMap);
+	m_Layers.Init(m_pMap);
+	m_pGameGroup = 0;
+	m_pGameLayer = 0;
+	m_GameLayerIndex = -1;
+
+	m_pLayerTiles = new CLayerTiles[NumLayers()];
+	for(int i = 0; i < NumLayers(); i++)
+	{
+		m_pLayerTiles[i].m_pLayers = this;
+		m_pLayerTiles[i].m_Index = i;
+		m_pLayerTiles[i].m_State = CLayerTiles::STATE_NONE;
+		m_pLayerTiles[i].m_pTiles = 0;
+		m_pLayerTiles[i].m_Data = -1;
+	}
 
+	InitIndex();
 	InitGameLayer();
-	InitTilemapSkip();
 }
 
-void CLayers::InitGameLayer()
+void CLayers::InitIndex()
 {
+	m_LayerGroups.set_size(NumLayers());
+	for(int i = 0; i < NumLayers(); i++)
+		m_LayerGroups[i] = -1;
+	m_Tilemaps.clear();
+	m_QuadLayers.clear();
+
+	// walk the groups in render order, a layer belongs to the first group that lists it
 	for(int g = 0; g < NumGroups(); g++)
 	{
 		CMapItemGroup *pGroup = GetGroup(g);
 		for(int l = 0; l < pGroup->m_NumLayers; l++)
 		{
-			CMapItemLayer *pLayer = GetLayer(pGroup->m_StartLayer+l);
+			int Layer = pGroup->m_StartLayer+l;
+			CMapItemLayer *pLayer = GetLayer(Layer);
+			if(!pLayer || m_LayerGroups[Layer] != -1)
+				continue;
+
+			m_LayerGroups[Layer] = g;
 			if(pLayer->m_Type == LAYERTYPE_TILES)
-			{
-				CMapItemLayerTilemap *pTilemap = reinterpret_cast<CMapItemLayerTilemap *>(pLayer);
-				if(pTilemap->m_Flags&TILESLAYERFLAG_GAME)
-				{
-					m_pGameLayer = pTilemap;
-					m_pGameGroup = pGroup;
-
-					// make sure the game group has standard settings
-					m_pGameGroup->m_OffsetX = 0;
-					m_pGameGroup->m_OffsetY = 0;
-					m_pGameGroup->m_ParallaxX = 100;
-					m_pGameGroup->m_ParallaxY = 100;
-
-					if(m_pGameGroup->m_Version >= 2)
-					{
-						m_pGameGroup->m_UseClipping = 0;
-						m_pGameGroup->m_ClipX = 0;
-						m_pGameGroup->m_ClipY = 0;
-						m_pGameGroup->m_ClipW = 0;
-						m_pGameGroup->m_ClipH = 0;
-					}
-
-					return; // there can only be one game layer and game group
-				}
-			}
+				m_Tilemaps.add(Layer);
+			else if(pLayer->m_Type == LAYERTYPE_QUADS)
+				m_QuadLayers.add(Layer);
 		}
 	}
 }
 
-void CLayers::InitTilemapSkip()
+void CLayers::ClearTiles()
 {
-	for(int g = 0; g < NumGroups(); g++)
+	if(!m_pLayerTiles)
+		return;
+
+	// a reloaded map dropped the pins already
+	const bool Pinned = m_pMap->Serial() == m_MapSerial;
+	for(int i = 0; i < NumLayers(); i++)
 	{
-		CMapItemGroup *pGroup = GetGroup(g);
-		for(int l = 0; l < pGroup->m_NumLayers; l++)
+		while(m_pLayerTiles[i].m_Job.Status() != CJob::STATE_DONE)
+			thread_yield();
+		if(Pinned && m_pLayerTiles[i].m_Data != -1)
+			m_pMap->UnpinData(m_pLayerTiles[i].m_Data);
+	}
+	delete[] m_pLayerTiles;
+	m_pLayerTiles = 0;
+}
+
+void CLayers::InitGameLayer()
+{
+	for(int t = 0; t < NumTilemaps(); t++)
+	{
+		CMapItemLayerTilemap *pTilemap = GetTilemap(t);
+		if(pTilemap->m_Flags&TILESLAYERFLAG_GAME)
 		{
-			CMapItemLayer *pLayer = GetLayer(pGroup->m_StartLayer+l);
-			if(pLayer->m_Type == LAYERTYPE_TILES)
+			m_pGameLayer = pTilemap;
+			m_GameLayerIndex = GetTilemapLayer(t);
+			const int Group = GetLayerGroup(m_GameLayerIndex);
+			m_pGameGroup = GetGroup(Group);
+
+			// make sure the game group has standard settings
+			m_pGameGroup->m_OffsetX = 0;
+			m_pGameGroup->m_OffsetY = 0;
+			m_pGameGroup->m_ParallaxX = 100;
+			m_pGameGroup->m_ParallaxY = 100;
+
+			// older groups are upgraded to the current layout
+			m_pGameGroup->m_UseClipping = 0;
+			m_pGameGroup->m_ClipX = 0;
+			m_pGameGroup->m_ClipY = 0;
+			m_pGameGroup->m_ClipW = 0;
+			m_pGameGroup->m_ClipH = 0;
+
+			// the view holds a copy of upgraded groups, write the fields the stored item has back to the map
+			void *pItem = m_pMap->GetItem(m_Groups.Start()+Group, 0, 0);
+			if(pItem != m_pGameGroup)
+				mem_copy(pItem, m_pGameGroup, minimum(m_pMap->GetItemSize(m_Groups.Start()+Group), (int)sizeof(CMapItemGroup)));
+
+			return; // there can only be one game layer and game group
+		}
+	}
+}
+
+// returns the first tile in [Start, End) with an index, End if there is none
+static int FindTile(const CTile *pTiles, int Start, int End)
+{
+	int i = Start;
+#if defined(CONF_SSE2)
+	// look at the index bytes of 16 tiles at once
+	const __m128i IndexMask = _mm_set1_epi32(0xff);
+	const __m128i Zero = _mm_setzero_si128();
+	for(; i+16 <= End; i += 16)
+	{
+		const __m128i *pBlock = (const __m128i *)(pTiles+i);
+		__m128i A = _mm_and_si128(_mm_loadu_si128(pBlock), IndexMask);
+		__m128i B = _mm_and_si128(_mm_loadu_si128(pBlock+1), IndexMask);
+		__m128i C = _mm_and_si128(_mm_loadu_si128(pBlock+2), IndexMask);
+		__m128i D = _mm_and_si128(_mm_loadu_si128(pBlock+3), IndexMask);
+		__m128i Indices = _mm_packs_epi16(_mm_packs_epi32(A, B), _mm_packs_epi32(C, D));
+		int Mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(Indices, Zero))&0xffff;
+		if(Mask)
+		{
+			for(; !(Mask&1); Mask >>= 1)
+				i++;
+			return i;
+		}
+	}
+#endif
+	for(; i < End; i++)
+	{
+		if(pTiles[i].m_Index)
+			return i;
+	}
+	return End;
+}
+
+void CLayers::InitTilemapSkip(CLayerTiles *pLayerTiles)
+{
+	CMapItemLayerTilemap *pTilemap = MapItemTilemap(GetLayer(pLayerTiles->m_Index));
+	Map()->PinData(pTilemap->m_Data);
+	pLayerTiles->m_Data = pTilemap->m_Data;
+	CTile *pTiles = (CTile *)Map()->GetData(pTilemap->m_Data);
+	if(pTiles)
+	{
+		// every run of empty tiles stores its length in the tile before it, at most 254
+		for(int y = 0; y < pTilemap->m_Height; y++)
+		{
+			CTile *pRow = pTiles+y*pTilemap->m_Width;
+			for(int x = 1; x < pTilemap->m_Width;)
 			{
-				CMapItemLayerTilemap *pTilemap = (CMapItemLayerTilemap *)pLayer;
-				CTile *pTiles = (CTile *)Map()->GetData(pTilemap->m_Data);
-				for(int y = 0; y < pTilemap->m_Height; y++)
-				{
-					for(int x = 1; x < pTilemap->m_Width;)
-					{
-						int SkippedX;
-						for(SkippedX = 1; x+SkippedX < pTilemap->m_Width && SkippedX < 255; SkippedX++)
-						{
-							if(pTiles[y*pTilemap->m_Width+x+SkippedX].m_Index)
-								break;
-						}
-
-						pTiles[y*pTilemap->m_Width+x].m_Skip = SkippedX-1;
-						x += SkippedX;
-					}
-				}
+				int SkippedX = FindTile(pRow, x+1, minimum(pTilemap->m_Width, x+255))-x;
+				pRow[x].m_Skip = SkippedX-1;
+				x += SkippedX;
 			}
 		}
 	}
+	pLayerTiles->m_pTiles = pTiles;
 }
 
-CMapItemGroup *CLayers::GetGroup(int Index) const
+CTile *CLayers::GetTiles(int LayerIndex)
 {
-	return static_cast<CMapItemGroup *>(m_pMap->GetItem(m_GroupsStart+Index, 0, 0));
+	if(LayerIndex < 0 || LayerIndex >= NumLayers() || !MapItemTilemap(GetLayer(LayerIndex)))
+		return 0;
+
+	// the first caller computes the skips, everyone else waits for it
+	CLayerTiles *pLayerTiles = &m_pLayerTiles[LayerIndex];
+	if(pLayerTiles->m_State != CLayerTiles::STATE_DONE)
+	{
+		if(atomic_compswap(&pLayerTiles->m_State, CLayerTiles::STATE_NONE, CLayerTiles::STATE_BUSY) == CLayerTiles::STATE_NONE)
+		{
+			InitTilemapSkip(pLayerTiles);
+			sync_barrier();
+			pLayerTiles->m_State = CLayerTiles::STATE_DONE;
+		}
+		else
+		{
+			while(pLayerTiles->m_State != CLayerTiles::STATE_DONE)
+				thread_yield();
+			sync_barrier();
+		}
+	}
+	return pLayerTiles->m_pTiles;
 }
 
-CMapItemLayer *CLayers::GetLayer(int Index) const
+int CLayers::TilemapSkipJob(void *pUser)
 {
-	return static_cast<CMapItemLayer *>(m_pMap->GetItem(m_LayersStart+Index, 0, 0));
+	CLayerTiles *pLayerTiles = static_cast<CLayerTiles *>(pUser);
+	pLayerTiles->m_pLayers->GetTiles(pLayerTiles->m_Index);
+	return 0;
+}
+
+void CLayers::InitTilemapSkip(CJobPool *pJobPool)
+{
+	for(int t = 0; t < NumTilemaps(); t++)
+	{
+		CLayerTiles *pLayerTiles = &m_pLayerTiles[GetTilemapLayer(t)];
+		if(pLayerTiles->m_State == CLayerTiles::STATE_NONE && pLayerTiles->m_Job.Status() == CJob::STATE_DONE)
+			pJobPool->Add(&pLayerTiles->m_Job, TilemapSkipJob, pLayerTiles);
+	}
 }
@@ -3,32 +3,59 @@
 #ifndef GAME_LAYERS_H
 #define GAME_LAYERS_H
 
+#include <base/tl/array.h>
 #include <engine/map.h>
 #include <game/mapitems.h>
+#include <game/mapitemview.h>
 
 class CLayers
 {
-	int m_GroupsNum;
-	int m_GroupsStart;
-	int m_LayersNum;
-	int m_LayersStart;
+	CMapItemView<CMapItemGroup> m_Groups;
+	CMapItemView<CMapItemLayer> m_Layers;
+	array<int> m_LayerGroups;
+	array<int> m_Tilemaps;
+	array<int> m_QuadLayers;
 	CMapItemGroup *m_pGameGroup;
 	CMapItemLayerTilemap *m_pGameLayer;
+	int m_GameLayerIndex;
 	class IMap *m_pMap;
+	unsigned m_MapSerial; // of the load the tiles are pinned in
+	struct CLayerTiles *m_pLayerTiles;
 
+	void InitIndex();
 	void InitGameLayer();
-	void InitTilemapSkip();
+	void InitTilemapSkip(struct CLayerTiles *pLayerTiles);
+	static int TilemapSkipJob(void *pUser);
+	void ClearTiles();
 
 public:
 	CLayers();
+	~CLayers();
 	void Init(class IKernel *pKernel, class IMap *pMap=0);
-	int NumGroups() const { return m_GroupsNum; }
-	int NumLayers() const { return m_LayersNum; }
+	// computes the tile skips of all tilemap layers on the job pool, the pool must outlive the layers.
+	// The map is read from several threads, so it must not have a memory budget
+	void InitTilemapSkip(class CJobPool *pJobPool);
+	// the tiles of a tilemap layer with their skips computed. They are loaded on first use
+	// and stay pinned until the layers are initialized again or destroyed
+	CTile *GetTiles(int LayerIndex);
+	int NumGroups() const { return m_Groups.Num(); }
+	int NumLayers() const { return m_Layers.Num(); }
 	class IMap *Map() const { return m_pMap; }
 	CMapItemGroup *GameGroup() const { return m_pGameGroup; }
 	CMapItemLayerTilemap *GameLayer() const { return m_pGameLayer; }
-	CMapItemGroup *GetGroup(int Index) const;
-	CMapItemLayer *GetLayer(int Index) const;
+	int GameLayerIndex() const { return m_GameLayerIndex; }
+	CMapItemGroup *GetGroup(int Index) const { return m_Groups.Get(Index); }
+	CMapItemLayer *GetLayer(int Index) const { return m_Layers.Get(Index); }
+
+	// the group that owns the layer, -1 if no group does
+	int GetLayerGroup(int LayerIndex) const { return LayerIndex >= 0 && LayerIndex < m_LayerGroups.size() ? m_LayerGroups[LayerIndex] : -1; }
+	// the indices of the tilemap and quad layers that belong to a group, in render order
+	int NumTilemaps() const { return m_Tilemaps.size(); }
+	int GetTilemapLayer(int Index) const { return m_Tilemaps[Index]; }
+	CMapItemLayerTilemap *GetTilemap(int Index) const { return MapItemTilemap(GetLayer(m_Tilemaps[Index])); }
+	int NumQuadLayers() const { return m_QuadLayers.size(); }
+	int GetQuadLayer(int Index) const { return m_QuadLayers[Index]; }
+	CMapItemLayerQuads *GetQuads(int Index) const { return MapItemQuads(GetLayer(m_QuadLayers[Index])); }
 };
 
 #endif
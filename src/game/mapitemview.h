@@ -0,0 +1,175 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+#ifndef GAME_MAPITEMVIEW_H
+#define GAME_MAPITEMVIEW_H
+
+#include <base/system.h>
+#include <engine/graphics.h>
+#include <engine/map.h>
+
+#include "mapitems.h"
+
+// the items are used as they are stored in the datafile, their layout must not change
+static_assert(sizeof(CTile) == 4, "CTile layout changed");
+static_assert(sizeof(CQuad) == 38*sizeof(int), "CQuad layout changed");
+static_assert(sizeof(CMapItemInfo) == 5*sizeof(int), "CMapItemInfo layout changed");
+static_assert(sizeof(CMapItemImage_v1) == 6*sizeof(int), "CMapItemImage_v1 layout changed");
+static_assert(sizeof(CMapItemImage) == 7*sizeof(int), "CMapItemImage layout changed");
+static_assert(sizeof(CMapItemGroup_v1) == 7*sizeof(int), "CMapItemGroup_v1 layout changed");
+static_assert(sizeof(CMapItemGroup) == 15*sizeof(int), "CMapItemGroup layout changed");
+static_assert(sizeof(CMapItemLayer) == 3*sizeof(int), "CMapItemLayer layout changed");
+static_assert(sizeof(CMapItemLayerTilemap) == 18*sizeof(int), "CMapItemLayerTilemap layout changed");
+static_assert(sizeof(CMapItemLayerQuads) == 10*sizeof(int), "CMapItemLayerQuads layout changed");
+static_assert(sizeof(CMapItemVersion) == 1*sizeof(int), "CMapItemVersion layout changed");
+static_assert(sizeof(CEnvPoint_v1) == 6*sizeof(int), "CEnvPoint_v1 layout changed");
+static_assert(sizeof(CEnvPoint) == 22*sizeof(int), "CEnvPoint layout changed");
+static_assert(sizeof(CMapItemEnvelope_v1) == 12*sizeof(int), "CMapItemEnvelope_v1 layout changed");
+static_assert(sizeof(CMapItemEnvelope) == 13*sizeof(int), "CMapItemEnvelope layout changed");
+
+// item type, size of the current version and defaults for fields that older versions lack
+template<class T> struct CMapItemTraits;
+
+template<> struct CMapItemTraits<CMapItemVersion>
+{
+	enum { TYPE=MAPITEMTYPE_VERSION };
+	static int Size(const CMapItemVersion *pItem) { return sizeof(CMapItemVersion); }
+	static void Upgrade(CMapItemVersion *pItem) {}
+};
+
+template<> struct CMapItemTraits<CMapItemInfo>
+{
+	enum { TYPE=MAPITEMTYPE_INFO };
+	static int Size(const CMapItemInfo *pItem) { return sizeof(CMapItemInfo); }
+	static void Upgrade(CMapItemInfo *pItem) {}
+};
+
+template<> struct CMapItemTraits<CMapItemImage>
+{
+	enum { TYPE=MAPITEMTYPE_IMAGE };
+	static int Size(const CMapItemImage *pItem) { return sizeof(CMapItemImage); }
+	static void Upgrade(CMapItemImage *pItem) { pItem->m_Format = CImageInfo::FORMAT_RGBA; } // v1 images are always rgba
+};
+
+template<> struct CMapItemTraits<CMapItemEnvelope>
+{
+	enum { TYPE=MAPITEMTYPE_ENVELOPE };
+	static int Size(const CMapItemEnvelope *pItem) { return sizeof(CMapItemEnvelope); }
+	static void Upgrade(CMapItemEnvelope *pItem) {}
+};
+
+template<> struct CMapItemTraits<CMapItemGroup>
+{
+	enum { TYPE=MAPITEMTYPE_GROUP };
+	static int Size(const CMapItemGroup *pItem) { return sizeof(CMapItemGroup); }
+	static void Upgrade(CMapItemGroup *pItem) {}
+};
+
+template<> struct CMapItemTraits<CMapItemLayer>
+{
+	enum { TYPE=MAPITEMTYPE_LAYER };
+	// layers are stored with the layout of their layer type
+	static int Size(const CMapItemLayer *pItem)
+	{
+		switch(pItem->m_Type)
+		{
+		case LAYERTYPE_TILES: return sizeof(CMapItemLayerTilemap);
+		case LAYERTYPE_QUADS: return sizeof(CMapItemLayerQuads);
+		}
+		return sizeof(CMapItemLayer);
+	}
+	static void Upgrade(CMapItemLayer *pItem) {}
+};
+
+// returns the layer as the given layer type or 0 if it is of another type
+inline CMapItemLayerTilemap *MapItemTilemap(CMapItemLayer *pLayer)
+{
+	return pLayer && pLayer->m_Type == LAYERTYPE_TILES ? reinterpret_cast<CMapItemLayerTilemap *>(pLayer) : 0;
+}
+
+inline CMapItemLayerQuads *MapItemQuads(CMapItemLayer *pLayer)
+{
+	return pLayer && pLayer->m_Type == LAYERTYPE_QUADS ? reinterpret_cast<CMapItemLayerQuads *>(pLayer) : 0;
+}
+
+// all items of one type, looked up once. Items stored with an older, shorter version are
+// copied into the current layout, so the fields of every version can be accessed directly.
+template<class T>
+class CMapItemView
+{
+	T **m_ppItems;
+	char *m_pUpgraded;
+	int m_Start;
+	int m_Num;
+
+	static int FullSize(const T *pItem, int ItemSize)
+	{
+		// too short items can't even tell their layout
+		return ItemSize < (int)sizeof(T) ? (int)sizeof(T) : CMapItemTraits<T>::Size(pItem);
+	}
+
+	CMapItemView(const CMapItemView &Other);
+	CMapItemView &operator=(const CMapItemView &Other);
+
+public:
+	CMapItemView() : m_ppItems(0), m_pUpgraded(0), m_Start(0), m_Num(0) {}
+	~CMapItemView() { Clear(); }
+
+	void Init(IMap *pMap)
+	{
+		Clear();
+		pMap->GetType(CMapItemTraits<T>::TYPE, &m_Start, &m_Num);
+		if(m_Num <= 0)
+		{
+			m_Num = 0;
+			return;
+		}
+
+		m_ppItems = (T **)mem_alloc(m_Num*sizeof(T *));
+		int UpgradedSize = 0;
+		for(int i = 0; i < m_Num; i++)
+		{
+			m_ppItems[i] = static_cast<T *>(pMap->GetItem(m_Start+i, 0, 0));
+			int ItemSize = pMap->GetItemSize(m_Start+i);
+			int Size = FullSize(m_ppItems[i], ItemSize);
+			if(ItemSize < Size)
+				UpgradedSize += Size;
+		}
+		if(!UpgradedSize)
+			return;
+
+		m_pUpgraded = (char *)mem_alloc(UpgradedSize);
+		mem_zero(m_pUpgraded, UpgradedSize);
+		for(int i = 0, Offset = 0; i < m_Num; i++)
+		{
+			int ItemSize = pMap->GetItemSize(m_Start+i);
+			int Size = FullSize(m_ppItems[i], ItemSize);
+			if(ItemSize >= Size)
+				continue;
+			T *pUpgraded = (T *)(m_pUpgraded+Offset);
+			if(ItemSize > 0)
+				mem_copy(pUpgraded, m_ppItems[i], ItemSize);
+			CMapItemTraits<T>::Upgrade(pUpgraded);
+			m_ppItems[i] = pUpgraded;
+			Offset += Size;
+		}
+	}
+
+	void Clear()
+	{
+		mem_free(m_ppItems);
+		mem_free(m_pUpgraded);
+		m_ppItems = 0;
+		m_pUpgraded = 0;
+		m_Start = 0;
+		m_Num = 0;
+	}
+
+	int Start() const { return m_Start; } // item index of the first item
+	int Num() const { return m_Num; }
+	T *operator[](int Index) const { return m_ppItems[Index]; }
+	T *Get(int Index) const { return Index >= 0 && Index < m_Num ? m_ppItems[Index] : 0; }
+	T * const *begin() const { return m_ppItems; }
+	T * const *end() const { return m_ppItems+m_Num; }
+};
+
+#endif
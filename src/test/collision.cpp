@@ -0,0 +1,483 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+#include <gtest/gtest.h>
+
+#include <base/math.h>
+#include <engine/shared/datafile.h>
+#include <engine/shared/jobs.h>
+#include <game/collision.h>
+#include <game/layers.h>
+
+#include "testmap.h"
+
+static void AddGameLayer(CDataFileWriter *pWriter, int Width, int Height, const CTile *pTiles)
+{
+	AddGroup(pWriter, 0, CMapItemGroup::CURRENT_VERSION, 0, 1);
+	AddTilemap(pWriter, 0, Width, Height, TILESLAYERFLAG_GAME, pTiles);
+}
+
+// same sequence on every platform
+static unsigned s_Seed;
+static int TestRandom(int Max)
+{
+	s_Seed = s_Seed*1103515245+12345;
+	return (s_Seed>>16)%Max;
+}
+
+static void RandomTiles(CTile *pTiles, int Num)
+{
+	static const int s_aIndices[] = {TILE_AIR, TILE_AIR, TILE_AIR, TILE_AIR, TILE_AIR, TILE_SOLID, TILE_DEATH, TILE_NOHOOK, 200};
+	mem_zero(pTiles, Num*sizeof(CTile));
+	for(int i = 0; i < Num; i++)
+		pTiles[i].m_Index = s_aIndices[TestRandom(sizeof(s_aIndices)/sizeof(s_aIndices[0]))];
+}
+
+static vec2 RandomPos(int Width, int Height)
+{
+	return vec2(TestRandom((Width+4)*32*4)/4.0f-64.0f, TestRandom((Height+4)*32*4)/4.0f-64.0f);
+}
+
+// the one sample per pixel walk IntersectLine used to do
+static int ReferenceIntersectLine(const CCollision *pCollision, vec2 Pos0, vec2 Pos1, vec2 *pOutCollision, vec2 *pOutBeforeCollision)
+{
+	const int End = distance(Pos0, Pos1)+1;
+	const float InverseEnd = 1.0f/End;
+	vec2 Last = Pos0;
+
+	for(int i = 0; i <= End; i++)
+	{
+		vec2 Pos = mix(Pos0, Pos1, i*InverseEnd);
+		if(pCollision->CheckPoint(Pos.x, Pos.y))
+		{
+			*pOutCollision = Pos;
+			*pOutBeforeCollision = Last;
+			return pCollision->GetCollisionAt(Pos.x, Pos.y);
+		}
+		Last = Pos;
+	}
+	*pOutCollision = Pos1;
+	*pOutBeforeCollision = Pos1;
+	return 0;
+}
+
+TEST(Collision, Flags)
+{
+	CTile aTiles[3*2];
+	mem_zero(aTiles, sizeof(aTiles));
+	aTiles[0].m_Index = TILE_SOLID;
+	aTiles[1].m_Index = TILE_DEATH;
+	aTiles[2].m_Index = TILE_NOHOOK;
+	aTiles[3].m_Index = 200;
+	aTiles[4].m_Index = 100;
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, 3, 2, aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CCollision Collision;
+	Collision.Init(&Layers);
+	Collision.Init(&Layers);
+
+	EXPECT_EQ(Collision.GetWidth(), 3);
+	EXPECT_EQ(Collision.GetHeight(), 2);
+	EXPECT_EQ(Collision.GetCollisionAt(16, 16), CCollision::COLFLAG_SOLID);
+	EXPECT_EQ(Collision.GetCollisionAt(48, 16), CCollision::COLFLAG_DEATH);
+	EXPECT_EQ(Collision.GetCollisionAt(80, 16), CCollision::COLFLAG_SOLID|CCollision::COLFLAG_NOHOOK);
+	EXPECT_EQ(Collision.GetCollisionAt(16, 48), 0);
+	EXPECT_EQ(Collision.GetCollisionAt(48, 48), 0);
+	EXPECT_EQ(Collision.GetCollisionAt(80, 48), 0);
+
+	// outside the map the border continues
+	EXPECT_EQ(Collision.GetCollisionAt(-1000, -1000), CCollision::COLFLAG_SOLID);
+	EXPECT_EQ(Collision.GetCollisionAt(1000, -5), CCollision::COLFLAG_SOLID|CCollision::COLFLAG_NOHOOK);
+	EXPECT_EQ(Collision.GetCollisionAt(1000, 1000), 0);
+
+	// the map keeps its tiles
+	const CTile *pTiles = Layers.GetTiles(Layers.GameLayerIndex());
+	for(int i = 0; i < 3*2; i++)
+		EXPECT_EQ(pTiles[i].m_Index, aTiles[i].m_Index);
+}
+
+TEST(Collision, IntersectLine)
+{
+	const int Width = 24, Height = 16;
+	CTile aTiles[Width*Height];
+	s_Seed = 1;
+	RandomTiles(aTiles, Width*Height);
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, Width, Height, aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CCollision Collision;
+	Collision.Init(&Layers);
+
+	int Hits = 0, Same = 0;
+	for(int i = 0; i < 5000; i++)
+	{
+		vec2 Pos0 = RandomPos(Width, Height);
+		vec2 Pos1 = i%4 ? RandomPos(Width, Height) : vec2(Pos0.x+TestRandom(256)-128, Pos0.y); // some flat rays
+		vec2 Col, Before, RefCol, RefBefore;
+		int Result = Collision.IntersectLine(Pos0, Pos1, &Col, &Before);
+		int RefResult = ReferenceIntersectLine(&Collision, Pos0, Pos1, &RefCol, &RefBefore);
+		if(RefResult)
+			Hits++;
+		if(Result == RefResult && Col == RefCol && Before == RefBefore)
+		{
+			Same++;
+			continue;
+		}
+
+		// the sampling stepped over a tile corner, the exact walk hits it earlier
+		ASSERT_TRUE(Result&CCollision::COLFLAG_SOLID);
+		if(RefResult)
+		{
+			EXPECT_LE(distance(Pos0, Col), distance(Pos0, RefCol));
+		}
+		// it can be a very thin cut, look closely right behind the hit position
+		vec2 Dir = normalize(Pos1-Pos0);
+		bool Inside = false;
+		for(int k = 0; k <= 40 && !Inside; k++)
+			Inside = Collision.CheckPoint(Col + Dir*(k*0.0005f));
+		EXPECT_TRUE(Inside);
+		EXPECT_LE(distance(Col, Before), 1.5f);
+	}
+	EXPECT_GT(Hits, 1000);
+	// it can't be exact, the reference samples once per pixel and misses tile corners a ray
+	// only cuts between two samples. Every such case is checked above to be a real hit
+	EXPECT_GT(Same, 4900);
+}
+
+TEST(Collision, IntersectLineCorner)
+{
+	CTile aTiles[4*4];
+	mem_zero(aTiles, sizeof(aTiles));
+	aTiles[1*4+1].m_Index = TILE_NOHOOK;
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, 4, 4, aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CCollision Collision;
+	Collision.Init(&Layers);
+
+	// cuts a 0.3 units wide corner of the tile, no pixel sample lands on it
+	vec2 Pos0(20.0f, 43.2f), Pos1(43.2f, 20.0f);
+	vec2 Col, Before, RefCol, RefBefore;
+	EXPECT_EQ(ReferenceIntersectLine(&Collision, Pos0, Pos1, &RefCol, &RefBefore), 0);
+	EXPECT_EQ(Collision.IntersectLine(Pos0, Pos1, &Col, &Before), CCollision::COLFLAG_SOLID|CCollision::COLFLAG_NOHOOK);
+	EXPECT_NEAR(Col.x, 31.5f, 0.001f);
+	EXPECT_NEAR(Col.y, 31.7f, 0.001f);
+	EXPECT_LT(Before.x, Col.x);
+
+	// starting inside a tile hits right away
+	EXPECT_EQ(Collision.IntersectLine(vec2(40.0f, 40.0f), vec2(100.0f, 100.0f), &Col, &Before), CCollision::COLFLAG_SOLID|CCollision::COLFLAG_NOHOOK);
+	EXPECT_TRUE(Col == vec2(40.0f, 40.0f));
+	EXPECT_TRUE(Before == vec2(40.0f, 40.0f));
+
+	// misses leave both positions at the end
+	EXPECT_EQ(Collision.IntersectLine(vec2(0.0f, 0.0f), vec2(200.0f, 0.0f), &Col, &Before), 0);
+	EXPECT_TRUE(Col == vec2(200.0f, 0.0f));
+	EXPECT_TRUE(Before == vec2(200.0f, 0.0f));
+}
+
+// the one step per pixel MoveBox used to do
+static void ReferenceMoveBox(const CCollision *pCollision, vec2 *pInoutPos, vec2 *pInoutVel, vec2 Size, float Elasticity, bool *pDeath)
+{
+	vec2 Pos = *pInoutPos;
+	vec2 Vel = *pInoutVel;
+	const float Distance = length(Vel);
+	const int Max = (int)Distance;
+	*pDeath = false;
+
+	if(Distance > 0.00001f)
+	{
+		const float Fraction = 1.0f/(Max+1);
+		for(int i = 0; i <= Max; i++)
+		{
+			vec2 NewPos = Pos + Vel*Fraction;
+			if(pCollision->TestBox(NewPos, Size*(2.0f/3.0f), CCollision::COLFLAG_DEATH))
+				*pDeath = true;
+
+			if(pCollision->TestBox(NewPos, Size))
+			{
+				int Hits = 0;
+				if(pCollision->TestBox(vec2(Pos.x, NewPos.y), Size))
+				{
+					NewPos.y = Pos.y;
+					Vel.y *= -Elasticity;
+					Hits++;
+				}
+				if(pCollision->TestBox(vec2(NewPos.x, Pos.y), Size))
+				{
+					NewPos.x = Pos.x;
+					Vel.x *= -Elasticity;
+					Hits++;
+				}
+				if(Hits == 0)
+				{
+					NewPos.y = Pos.y;
+					Vel.y *= -Elasticity;
+					NewPos.x = Pos.x;
+					Vel.x *= -Elasticity;
+				}
+			}
+			Pos = NewPos;
+		}
+	}
+	*pInoutPos = Pos;
+	*pInoutVel = Vel;
+}
+
+TEST(Collision, MoveBox)
+{
+	const int Width = 24, Height = 16;
+	CTile aTiles[Width*Height];
+	s_Seed = 2;
+	RandomTiles(aTiles, Width*Height);
+	// sparse enough to fly through
+	for(int i = 0; i < Width*Height; i++)
+		if(TestRandom(3))
+			aTiles[i].m_Index = TILE_AIR;
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, Width, Height, aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CCollision Collision;
+	Collision.Init(&Layers);
+
+	static const float s_aElasticities[] = {0.0f, 0.5f, 1.0f};
+	const vec2 Size(28.0f, 28.0f);
+	int Deaths = 0, Bounces = 0;
+	for(int i = 0; i < 5000; i++)
+	{
+		vec2 Start = RandomPos(Width, Height);
+		const int MaxSpeed = i%10 ? 64 : 2048;
+		vec2 StartVel((TestRandom(MaxSpeed*8)-MaxSpeed*4)/4.0f, (TestRandom(MaxSpeed*8)-MaxSpeed*4)/4.0f);
+		if(i%7 == 0)
+			StartVel.y = 0.0f;
+		float Elasticity = s_aElasticities[i%3];
+
+		vec2 Pos = Start, Vel = StartVel, RefPos = Start, RefVel = StartVel;
+		bool Death, RefDeath;
+		Collision.MoveBox(&Pos, &Vel, Size, Elasticity, &Death);
+		ReferenceMoveBox(&Collision, &RefPos, &RefVel, Size, Elasticity, &RefDeath);
+		if(RefDeath)
+			Deaths++;
+		if(RefVel != StartVel)
+			Bounces++;
+
+		// skipping steps must not change the result
+		EXPECT_EQ(Death, RefDeath);
+		EXPECT_TRUE(Pos == RefPos);
+		EXPECT_TRUE(Vel == RefVel);
+	}
+	EXPECT_GT(Deaths, 500);
+	EXPECT_GT(Bounces, 500);
+}
+
+TEST(Collision, MoveBoxFast)
+{
+	// a corridor with a wall at the end
+	CTile aTiles[64*3];
+	mem_zero(aTiles, sizeof(aTiles));
+	for(int x = 0; x < 64; x++)
+	{
+		aTiles[x].m_Index = TILE_SOLID;
+		aTiles[2*64+x].m_Index = TILE_SOLID;
+	}
+	aTiles[64+60].m_Index = TILE_SOLID;
+	aTiles[64+30].m_Index = TILE_DEATH;
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, 64, 3, aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CCollision Collision;
+	Collision.Init(&Layers);
+
+	// stops in front of the wall without tunneling through it
+	vec2 Pos(48.0f, 48.0f), Vel(4000.0f, 0.0f);
+	bool Death;
+	Collision.MoveBox(&Pos, &Vel, vec2(28.0f, 28.0f), 0.0f, &Death);
+	EXPECT_TRUE(Death);
+	EXPECT_NEAR(Pos.x, 60*32-0.5f-14.0f-0.5f, 0.5f);
+	EXPECT_EQ(Pos.y, 48.0f);
+	EXPECT_EQ(Vel.x, 0.0f);
+
+	// bounces back for the rest of the move
+	Pos = vec2(48.0f, 48.0f);
+	Vel = vec2(4000.0f, 0.0f);
+	vec2 RefPos = Pos, RefVel = Vel;
+	bool RefDeath;
+	Collision.MoveBox(&Pos, &Vel, vec2(28.0f, 28.0f), 0.5f, &Death);
+	ReferenceMoveBox(&Collision, &RefPos, &RefVel, vec2(28.0f, 28.0f), 0.5f, &RefDeath);
+	EXPECT_TRUE(Death);
+	EXPECT_TRUE(RefDeath);
+	EXPECT_TRUE(Pos == RefPos);
+	EXPECT_EQ(Pos.y, 48.0f);
+	EXPECT_EQ(Vel.x, -2000.0f);
+	EXPECT_TRUE(Vel == RefVel);
+
+	// without asking for it the death tile is of no interest
+	Pos = vec2(48.0f, 48.0f);
+	Vel = vec2(100.0f, 0.0f);
+	Collision.MoveBox(&Pos, &Vel, vec2(28.0f, 28.0f), 0.5f);
+	EXPECT_NEAR(Pos.x, 148.0f, 0.01f);
+	EXPECT_EQ(Vel.x, 100.0f);
+}
+
+TEST(Collision, Batch)
+{
+	const int Width = 24, Height = 16;
+	CTile aTiles[Width*Height];
+	s_Seed = 3;
+	RandomTiles(aTiles, Width*Height);
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, Width, Height, aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CCollision Collision;
+	Collision.Init(&Layers);
+
+	// an odd number, so that the tail is tested too. Positions on the rounding edges included
+	const int Num = 1003;
+	static float s_aX[Num], s_aY[Num];
+	static unsigned char s_aFlags[Num];
+	for(int i = 0; i < Num; i++)
+	{
+		vec2 Pos = RandomPos(Width, Height);
+		s_aX[i] = i%5 ? Pos.x : round_to_int(Pos.x/32)*32-0.5f;
+		s_aY[i] = i%7 ? Pos.y : round_to_int(Pos.y/32)*32+0.5f;
+	}
+
+	Collision.GetCollisionsAt(s_aX, s_aY, Num, s_aFlags);
+	for(int i = 0; i < Num; i++)
+		EXPECT_EQ(s_aFlags[i], Collision.GetCollisionAt(s_aX[i], s_aY[i]));
+
+	static const int s_aFlagTypes[] = {CCollision::COLFLAG_SOLID, CCollision::COLFLAG_DEATH, CCollision::COLFLAG_NOHOOK};
+	const vec2 Size(28.0f, 28.0f);
+	Collision.TestBoxes(s_aX, s_aY, Num, Size, s_aFlags);
+	for(int i = 0; i < Num; i++)
+	{
+		for(unsigned f = 0; f < sizeof(s_aFlagTypes)/sizeof(s_aFlagTypes[0]); f++)
+			EXPECT_EQ((s_aFlags[i]&s_aFlagTypes[f]) != 0, Collision.TestBox(vec2(s_aX[i], s_aY[i]), Size, s_aFlagTypes[f]));
+	}
+}
+
+static int ReferenceDistance(const CCollision *pCollision, int TileX, int TileY)
+{
+	int Distance = CCollision::MAX_DISTANCE;
+	for(int y = 0; y < pCollision->GetHeight(); y++)
+	{
+		for(int x = 0; x < pCollision->GetWidth(); x++)
+		{
+			if(pCollision->GetCollisionAt(x*32, y*32)&CCollision::COLFLAG_SOLID)
+				Distance = minimum(Distance, maximum(absolute(x-TileX), absolute(y-TileY)));
+		}
+	}
+	return Distance;
+}
+
+TEST(Collision, DistanceField)
+{
+	const int Width = 80, Height = 70;
+	static CTile s_aTiles[Width*Height];
+	s_Seed = 4;
+	RandomTiles(s_aTiles, Width*Height);
+	// large empty areas, further away than MAX_DISTANCE from anything
+	for(int i = 0; i < Width*Height; i++)
+		if(i%Width >= 10 && TestRandom(50))
+			s_aTiles[i].m_Index = TILE_AIR;
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, Width, Height, s_aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CJobPool Pool;
+	Pool.Init(2);
+	CJobPool EmptyPool; // runs the jobs right away
+	CJobPool *apPools[3] = {0, &Pool, &EmptyPool};
+
+	for(int p = 0; p < 3; p++)
+	{
+		CCollision Collision;
+		Collision.Init(&Layers);
+		EXPECT_EQ(Collision.GetDistance(0, 0), 0);
+		Collision.InitDistanceField(apPools[p]);
+		for(int y = 0; y < Height; y++)
+			for(int x = 0; x < Width; x++)
+				ASSERT_EQ(Collision.GetDistance(x, y), ReferenceDistance(&Collision, x, y));
+		EXPECT_EQ(Collision.GetDistance(-5, 1000), Collision.GetDistance(0, Height-1));
+
+		// changes are picked up around them
+		Collision.SetTile(50, 35, CCollision::COLFLAG_SOLID);
+		Collision.SetTile(40, 20, 0);
+		Collision.SetTile(2, 2, CCollision::COLFLAG_DEATH);
+		EXPECT_EQ(Collision.GetCollisionAt(50*32, 35*32), CCollision::COLFLAG_SOLID);
+		for(int y = 0; y < Height; y++)
+			for(int x = 0; x < Width; x++)
+				ASSERT_EQ(Collision.GetDistance(x, y), ReferenceDistance(&Collision, x, y));
+	}
+}
+
+TEST(Collision, DistanceFieldTracing)
+{
+	const int Width = 80, Height = 70;
+	static CTile s_aTiles[Width*Height];
+	s_Seed = 5;
+	RandomTiles(s_aTiles, Width*Height);
+	for(int i = 0; i < Width*Height; i++)
+		if(TestRandom(40))
+			s_aTiles[i].m_Index = TILE_AIR;
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGameLayer(&Writer, Width, Height, s_aTiles);
+	CTestMap Map(&Writer);
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	CCollision Collision, Traced;
+	Collision.Init(&Layers);
+	Traced.Init(&Layers);
+	Traced.InitDistanceField();
+
+	int Hits = 0;
+	for(int i = 0; i < 5000; i++)
+	{
+		vec2 Pos0 = RandomPos(Width, Height);
+		vec2 Pos1 = RandomPos(Width, Height);
+		vec2 Col, Before, TracedCol, TracedBefore;
+		int Result = Collision.IntersectLine(Pos0, Pos1, &Col, &Before);
+		ASSERT_EQ(Traced.IntersectLine(Pos0, Pos1, &TracedCol, &TracedBefore), Result);
+		// corner hits report the tile entry which is computed a little differently after a jump
+		EXPECT_LT(distance(TracedCol, Col), 0.01f);
+		EXPECT_TRUE(TracedBefore == Before);
+		if(Result)
+			Hits++;
+
+		vec2 Vel = (Pos1-Pos0)*0.5f, TracedVel = Vel;
+		vec2 Pos = Pos0, TracedPos = Pos0;
+		Collision.MoveBox(&Pos, &Vel, vec2(28.0f, 28.0f), 0.5f);
+		Traced.MoveBox(&TracedPos, &TracedVel, vec2(28.0f, 28.0f), 0.5f);
+		EXPECT_TRUE(Pos == TracedPos);
+		EXPECT_TRUE(Vel == TracedVel);
+	}
+	EXPECT_GT(Hits, 1000);
+}
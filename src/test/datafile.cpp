@@ -5,6 +5,7 @@
 #include <gtest/gtest.h>
 
 #include <engine/shared/datafile.h>
+#include <engine/shared/jobs.h>
 #include <engine/storage.h>
 
 TEST(Datafile, RoundtripItemDataAndSize)
@@ -65,3 +66,980 @@ TEST(Datafile, RoundtripItemDataAndSize)
 
 	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
 }
+
+TEST(Datafile, MappedRoundtrip)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.Open(pStorage, aFilename));
+
+	static const char TEST_DATA[] = "Hello World!";
+	int Index = Writer.AddData(sizeof(TEST_DATA), TEST_DATA);
+	int aItem[2] = {Index, 1234};
+	Writer.AddItem(12, 34, sizeof(aItem), aItem);
+	EXPECT_TRUE(Writer.Finish());
+
+	CDataFileReader ReadReader;
+	ASSERT_TRUE(ReadReader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+	CDataFileReader Reader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL, CDataFileReader::OPENFLAG_MMAP));
+	EXPECT_EQ(sha256_comp(Reader.Sha256(), ReadReader.Sha256()), 0);
+	EXPECT_EQ(Reader.Crc(), ReadReader.Crc());
+
+	ASSERT_EQ(Reader.GetDataSize(Index), sizeof(TEST_DATA));
+	EXPECT_TRUE(mem_comp(Reader.GetData(Index), TEST_DATA, sizeof(TEST_DATA)) == 0);
+	EXPECT_TRUE(Reader.GetData(Reader.NumData()) == 0);
+
+	int *pItem = (int *)Reader.FindItem(12, 34);
+	ASSERT_TRUE(pItem);
+	EXPECT_TRUE(mem_comp(pItem, aItem, sizeof(aItem)) == 0);
+	// the mapping is private, writing to it must not touch the file
+	pItem[1] = 4321;
+
+	static const char REPL_DATA[] = "Replacement";
+	char *pReplace = (char *)mem_alloc(sizeof(REPL_DATA));
+	mem_copy(pReplace, REPL_DATA, sizeof(REPL_DATA));
+	Reader.ReplaceData(Index, pReplace, sizeof(REPL_DATA));
+	ASSERT_EQ(Reader.GetDataSize(Index), sizeof(REPL_DATA));
+	EXPECT_TRUE(mem_comp(Reader.GetData(Index), REPL_DATA, sizeof(REPL_DATA)) == 0);
+
+	EXPECT_TRUE(Reader.Close());
+	EXPECT_TRUE(ReadReader.Close());
+
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL, CDataFileReader::OPENFLAG_MMAP));
+	EXPECT_EQ(((int *)Reader.FindItem(12, 34))[1], 1234);
+	EXPECT_TRUE(Reader.Close());
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+static void WriteTestBlocks(IStorage *pStorage, const char *pFilename, int NumBlocks)
+{
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.Open(pStorage, pFilename));
+	int aData[256];
+	for(int i = 0; i < NumBlocks; i++)
+	{
+		for(int k = 0; k < 256; k++)
+			aData[k] = i*k;
+		Writer.AddData(sizeof(int)*(i+1), aData);
+	}
+	EXPECT_TRUE(Writer.Finish());
+}
+
+static bool CheckTestBlock(CDataFileReader *pReader, int Index)
+{
+	const int *pData = (const int *)pReader->GetData(Index);
+	if(!pData || pReader->GetDataSize(Index) != (int)sizeof(int)*(Index+1))
+		return false;
+	for(int k = 0; k <= Index; k++)
+	{
+		if(pData[k] != Index*k)
+			return false;
+	}
+	return true;
+}
+
+TEST(Datafile, Prefetch)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	const int NUM_BLOCKS = 64;
+	WriteTestBlocks(pStorage, aFilename, NUM_BLOCKS);
+
+	CJobPool JobPool;
+	JobPool.Init(4);
+
+	for(int Flags = 0; Flags <= CDataFileReader::OPENFLAG_MMAP; Flags += CDataFileReader::OPENFLAG_MMAP)
+	{
+		CDataFileReader Reader;
+		ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL, Flags));
+		EXPECT_TRUE(CheckTestBlock(&Reader, 3));
+		Reader.Prefetch(&JobPool);
+		for(int i = 0; i < NUM_BLOCKS; i += 2)
+			EXPECT_TRUE(CheckTestBlock(&Reader, i));
+		Reader.WaitPrefetch();
+		for(int i = 1; i < NUM_BLOCKS; i += 2)
+			EXPECT_TRUE(CheckTestBlock(&Reader, i));
+
+		// unload blocks that were never picked up
+		const int aIndices[] = {1, 5, 7};
+		for(unsigned i = 0; i < sizeof(aIndices)/sizeof(aIndices[0]); i++)
+			Reader.UnloadData(aIndices[i]);
+		Reader.Prefetch(&JobPool, aIndices, sizeof(aIndices)/sizeof(aIndices[0]));
+		Reader.UnloadData(5);
+		EXPECT_TRUE(CheckTestBlock(&Reader, 5));
+		EXPECT_TRUE(Reader.Close());
+	}
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, LazyHash)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	WriteTestBlocks(pStorage, aFilename, 16);
+
+	SHA256_DIGEST Sha256;
+	unsigned Crc;
+	unsigned Size;
+	ASSERT_TRUE(pStorage->GetHashAndSize(aFilename, IStorage::TYPE_SAVE, &Sha256, &Crc, &Size));
+
+	const int aFlags[] = {0, CDataFileReader::OPENFLAG_LAZY_HASH, CDataFileReader::OPENFLAG_MMAP, CDataFileReader::OPENFLAG_MMAP|CDataFileReader::OPENFLAG_LAZY_HASH};
+	for(unsigned i = 0; i < sizeof(aFlags)/sizeof(aFlags[0]); i++)
+	{
+		CDataFileReader Reader;
+		ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL, aFlags[i]));
+		EXPECT_TRUE(CheckTestBlock(&Reader, 2));
+		EXPECT_EQ(sha256_comp(Reader.Sha256(), Sha256), 0);
+		EXPECT_EQ(Reader.Crc(), Crc);
+		EXPECT_TRUE(CheckTestBlock(&Reader, 7));
+		EXPECT_TRUE(Reader.Close());
+	}
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+struct CConcurrentReadData
+{
+	CDataFileReader *m_pReader;
+	int m_NumBlocks;
+	int m_Offset;
+	bool m_Success;
+};
+
+static void ConcurrentReadThread(void *pUser)
+{
+	CConcurrentReadData *pData = (CConcurrentReadData *)pUser;
+	pData->m_Success = true;
+	for(int i = 0; i < pData->m_NumBlocks; i++)
+	{
+		int Index = (i+pData->m_Offset)%pData->m_NumBlocks;
+		if(!CheckTestBlock(pData->m_pReader, Index))
+			pData->m_Success = false;
+	}
+}
+
+TEST(Datafile, ConcurrentGetData)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	const int NUM_BLOCKS = 128;
+	const int NUM_THREADS = 8;
+	WriteTestBlocks(pStorage, aFilename, NUM_BLOCKS);
+
+	CJobPool JobPool;
+	JobPool.Init(2);
+
+	for(int Flags = 0; Flags <= CDataFileReader::OPENFLAG_MMAP; Flags += CDataFileReader::OPENFLAG_MMAP)
+	{
+		CDataFileReader Reader;
+		ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL, Flags));
+		Reader.Prefetch(&JobPool);
+
+		CConcurrentReadData aData[NUM_THREADS];
+		void *apThreads[NUM_THREADS];
+		for(int i = 0; i < NUM_THREADS; i++)
+		{
+			aData[i].m_pReader = &Reader;
+			aData[i].m_NumBlocks = NUM_BLOCKS;
+			aData[i].m_Offset = i%2 ? 0 : i*NUM_BLOCKS/NUM_THREADS;
+			apThreads[i] = thread_init(ConcurrentReadThread, &aData[i]);
+		}
+		for(int i = 0; i < NUM_THREADS; i++)
+		{
+			thread_wait(apThreads[i]);
+			thread_destroy(apThreads[i]);
+			EXPECT_TRUE(aData[i].m_Success);
+		}
+
+		EXPECT_TRUE(Reader.Close());
+	}
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, FindItem)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.Open(pStorage, aFilename));
+	for(int i = 0; i < 1000; i++)
+	{
+		// a few duplicated ids, the first one of them must be found
+		int aItem[2] = {i, (i*7919)%509};
+		Writer.AddItem(i%9*3, aItem[1], sizeof(aItem), aItem);
+	}
+	EXPECT_TRUE(Writer.Finish());
+
+	CDataFileReader Reader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+	for(int Type = -1; Type < 30; Type++)
+	{
+		int Start, Num;
+		Reader.GetType(Type, &Start, &Num);
+		EXPECT_EQ(Num, Type >= 0 && Type%3 == 0 && Type/3 < 9 ? (1000-Type/3+8)/9 : 0);
+		for(int ID = -1; ID < 520; ID++)
+		{
+			void *pExpected = 0;
+			for(int i = 0; i < Num && !pExpected; i++)
+			{
+				int ItemID;
+				void *pItem = Reader.GetItem(Start+i, 0, &ItemID);
+				if(ItemID == ID)
+					pExpected = pItem;
+			}
+			EXPECT_EQ(Reader.FindItem(Type, ID), pExpected);
+		}
+	}
+	EXPECT_TRUE(Reader.Close());
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, ManyItemsAndDatas)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.Open(pStorage, aFilename));
+	static const int NUM = 3000;
+	static const int s_aTypes[] = {0xfffe, 7, 0, 300};
+	for(int i = 0; i < NUM; i++)
+	{
+		int aData[2] = {i, -i};
+		EXPECT_EQ(Writer.AddData(sizeof(aData), aData), i);
+		int aItem[2] = {i, i*3};
+		EXPECT_EQ(Writer.AddItem(s_aTypes[i%4], i/4, sizeof(aItem), aItem), i);
+	}
+	EXPECT_TRUE(Writer.Finish());
+
+	CDataFileReader Reader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+	ASSERT_EQ(Reader.NumData(), NUM);
+	ASSERT_EQ(Reader.NumItems(), NUM);
+	for(int i = 0; i < NUM; i++)
+	{
+		const int *pData = (const int *)Reader.GetData(i);
+		ASSERT_EQ(Reader.GetDataSize(i), 2*(int)sizeof(int));
+		EXPECT_EQ(pData[0], i);
+		EXPECT_EQ(pData[1], -i);
+		Reader.UnloadData(i);
+	}
+
+	// items are grouped by ascending type and keep their insertion order
+	int PrevType = -1;
+	for(int i = 0, PrevID = -1; i < NUM; i++)
+	{
+		int Type, ID;
+		const int *pItem = (const int *)Reader.GetItem(i, &Type, &ID);
+		EXPECT_GE(Type, PrevType);
+		if(Type != PrevType)
+			PrevID = -1;
+		EXPECT_GT(ID, PrevID);
+		EXPECT_EQ(s_aTypes[pItem[0]%4], Type);
+		EXPECT_EQ(pItem[0]/4, ID);
+		EXPECT_EQ(pItem[1], pItem[0]*3);
+		PrevType = Type;
+		PrevID = ID;
+	}
+	for(unsigned t = 0; t < sizeof(s_aTypes)/sizeof(s_aTypes[0]); t++)
+	{
+		int Start, Num;
+		Reader.GetType(s_aTypes[t], &Start, &Num);
+		EXPECT_EQ(Num, NUM/4);
+		EXPECT_TRUE(Reader.FindItem(s_aTypes[t], NUM/4-1) != 0);
+	}
+	EXPECT_TRUE(Reader.Close());
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+static void WriteCompressTest(IStorage *pStorage, const char *pFilename, CJobPool *pJobPool)
+{
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.Open(pStorage, pFilename, pJobPool));
+	int aData[512];
+	for(int i = 0; i < 100; i++)
+	{
+		for(int k = 0; k < 512; k++)
+			aData[k] = (k*i)%7;
+		Writer.AddData(sizeof(int)*(i*5%512+1), aData);
+		if(i == 50)
+			Writer.Flush();
+	}
+	Writer.AddItem(1, 2, sizeof(int), aData);
+	EXPECT_TRUE(Writer.Finish());
+}
+
+TEST(Datafile, DeferredCompression)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	char aDeferredFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	Info.Filename(aDeferredFilename, sizeof(aDeferredFilename), "-deferred.datafile");
+	IStorage *pStorage = CreateTestStorage();
+
+	CJobPool JobPool;
+	JobPool.Init(2);
+	WriteCompressTest(pStorage, aFilename, 0);
+	WriteCompressTest(pStorage, aDeferredFilename, &JobPool);
+
+	// both modes have to produce the same file
+	CDataFileReader Reader;
+	CDataFileReader DeferredReader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+	ASSERT_TRUE(DeferredReader.Open(pStorage, aDeferredFilename, IStorage::TYPE_ALL));
+	EXPECT_TRUE(Reader.Sha256() == DeferredReader.Sha256());
+	ASSERT_EQ(DeferredReader.NumData(), 100);
+	for(int i = 0; i < 100; i++)
+	{
+		ASSERT_EQ(DeferredReader.GetDataSize(i), (int)sizeof(int)*(i*5%512+1));
+		const int *pData = (const int *)DeferredReader.GetData(i);
+		for(int k = 0; k <= i*5%512; k++)
+			EXPECT_EQ(pData[k], (k*i)%7);
+	}
+	EXPECT_TRUE(DeferredReader.Close());
+
+	// pools without threads or shut down run the jobs right away
+	CJobPool EmptyPool;
+	CJobPool StoppedPool;
+	StoppedPool.Init(1);
+	StoppedPool.Shutdown();
+	for(int i = 0; i < 2; i++)
+	{
+		WriteCompressTest(pStorage, aDeferredFilename, i ? &StoppedPool : &EmptyPool);
+		ASSERT_TRUE(DeferredReader.Open(pStorage, aDeferredFilename, IStorage::TYPE_ALL));
+		EXPECT_TRUE(Reader.Sha256() == DeferredReader.Sha256());
+		EXPECT_TRUE(DeferredReader.Close());
+	}
+	EXPECT_TRUE(Reader.Close());
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+	EXPECT_TRUE(pStorage->RemoveFile(aDeferredFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, CompressionPolicy)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+
+	static const int SIZE = 64*1024;
+	unsigned char *pNoise = (unsigned char *)mem_alloc(SIZE);
+	unsigned char *pPattern = (unsigned char *)mem_alloc(SIZE);
+	unsigned Seed = 1234567;
+	for(int i = 0; i < SIZE; i++)
+	{
+		Seed = Seed*1103515245+12345;
+		pNoise[i] = Seed>>24;
+		pPattern[i] = (i/16)%13;
+	}
+
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.Open(pStorage, aFilename));
+	Writer.SetCompression(CDataFileWriter::COMPRESSION_AUTO);
+	int Store = Writer.AddData(SIZE, pPattern, CDataFileWriter::COMPRESSION_STORE);
+	int Fast = Writer.AddData(SIZE, pPattern, CDataFileWriter::COMPRESSION_FAST);
+	int Max = Writer.AddData(SIZE, pPattern, CDataFileWriter::COMPRESSION_MAX);
+	int AutoPattern = Writer.AddData(SIZE, pPattern);
+	int AutoNoise = Writer.AddData(SIZE, pNoise);
+	EXPECT_TRUE(Writer.Finish());
+
+	CDataFileReader Reader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+	ASSERT_EQ(Reader.NumData(), 5);
+	for(int i = 0; i < Reader.NumData(); i++)
+	{
+		ASSERT_EQ(Reader.GetDataSize(i), SIZE);
+		EXPECT_EQ(mem_comp(Reader.GetData(i), i == AutoNoise ? pNoise : pPattern, SIZE), 0);
+	}
+	EXPECT_TRUE(Reader.Close());
+
+	// compare the compressed block sizes through the data offsets
+	IOHANDLE File = pStorage->OpenFile(aFilename, IOFLAG_READ, IStorage::TYPE_ALL);
+	ASSERT_TRUE(File);
+	int aHeader[9];
+	ASSERT_EQ(io_read(File, aHeader, sizeof(aHeader)), sizeof(aHeader));
+	int NumItemTypes = aHeader[4], NumItems = aHeader[5], DataSize = aHeader[8];
+	int aOffsets[6];
+	io_skip(File, NumItemTypes*3*sizeof(int) + NumItems*sizeof(int));
+	ASSERT_EQ(io_read(File, aOffsets, 5*sizeof(int)), 5*sizeof(int));
+	aOffsets[5] = DataSize;
+	io_close(File);
+	EXPECT_GE(aOffsets[Store+1]-aOffsets[Store], SIZE);
+	EXPECT_LT(aOffsets[Fast+1]-aOffsets[Fast], SIZE/8);
+	EXPECT_LE(aOffsets[Max+1]-aOffsets[Max], aOffsets[Fast+1]-aOffsets[Fast]);
+	EXPECT_LT(aOffsets[AutoPattern+1]-aOffsets[AutoPattern], SIZE/8);
+	EXPECT_GE(aOffsets[AutoNoise+1]-aOffsets[AutoNoise], SIZE);
+
+	mem_free(pNoise);
+	mem_free(pPattern);
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, RawPassthrough)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	char aCopyFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	Info.Filename(aCopyFilename, sizeof(aCopyFilename), "-copy.datafile");
+	IStorage *pStorage = CreateTestStorage();
+	WriteTestBlocks(pStorage, aFilename, 64);
+
+	for(int Flags = 0; Flags <= CDataFileReader::OPENFLAG_MMAP; Flags += CDataFileReader::OPENFLAG_MMAP)
+	{
+		CDataFileReader Reader;
+		ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL, Flags));
+
+		// an unchanged copy is byte identical
+		CDataFileWriter Writer;
+		ASSERT_TRUE(Writer.Open(pStorage, aCopyFilename));
+		for(int i = 0; i < Reader.NumData(); i++)
+			EXPECT_EQ(Writer.AddDataFrom(&Reader, i), i);
+		EXPECT_TRUE(Writer.Finish());
+		{
+			CDataFileReader Copy;
+			ASSERT_TRUE(Copy.Open(pStorage, aCopyFilename, IStorage::TYPE_ALL));
+			EXPECT_TRUE(Copy.Sha256() == Reader.Sha256());
+			EXPECT_TRUE(Copy.Close());
+		}
+
+		// replaced blocks are recompressed
+		char *pReplace = (char *)mem_alloc(sizeof(int)*8);
+		mem_zero(pReplace, sizeof(int)*8);
+		Reader.ReplaceData(5, pReplace, sizeof(int)*8);
+		EXPECT_EQ(Reader.GetRawDataSize(5), 0);
+		EXPECT_GT(Reader.GetRawDataSize(6), 0);
+		ASSERT_TRUE(Writer.Open(pStorage, aCopyFilename));
+		for(int i = 0; i < Reader.NumData(); i++)
+			Writer.AddDataFrom(&Reader, i);
+		EXPECT_TRUE(Writer.Finish());
+		{
+			CDataFileReader Copy;
+			ASSERT_TRUE(Copy.Open(pStorage, aCopyFilename, IStorage::TYPE_ALL));
+			ASSERT_EQ(Copy.NumData(), 64);
+			for(int i = 0; i < Copy.NumData(); i++)
+			{
+				if(i == 5)
+				{
+					ASSERT_EQ(Copy.GetDataSize(i), (int)sizeof(int)*8);
+					EXPECT_EQ(mem_comp(Copy.GetData(i), pReplace, sizeof(int)*8), 0);
+				}
+				else
+					EXPECT_TRUE(CheckTestBlock(&Copy, i));
+			}
+			EXPECT_TRUE(Copy.Close());
+		}
+		EXPECT_TRUE(Reader.Close());
+	}
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+	EXPECT_TRUE(pStorage->RemoveFile(aCopyFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, Deduplicate)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	char aCopyFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	Info.Filename(aCopyFilename, sizeof(aCopyFilename), "-copy.datafile");
+	IStorage *pStorage = CreateTestStorage();
+
+	// every block is added twice, without deduplication they are all kept
+	int aData[64];
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.Open(pStorage, aFilename));
+	for(int i = 0; i < 200; i++)
+	{
+		for(int k = 0; k < 64; k++)
+			aData[k] = (i/2)*k;
+		EXPECT_EQ(Writer.AddData(sizeof(aData), aData), i);
+	}
+	EXPECT_TRUE(Writer.Finish());
+
+	CDataFileReader Reader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+	ASSERT_EQ(Reader.NumData(), 200);
+
+	// passed through blocks are matched by their compressed bytes
+	Writer.SetDeduplicate(true);
+	ASSERT_TRUE(Writer.Open(pStorage, aCopyFilename));
+	for(int i = 0; i < Reader.NumData(); i++)
+		EXPECT_EQ(Writer.AddDataFrom(&Reader, i), i/2);
+	// recompressed blocks are matched by their contents and the size
+	for(int i = 0; i < 200; i++)
+	{
+		for(int k = 0; k < 64; k++)
+			aData[k] = i*k;
+		EXPECT_EQ(Writer.AddData(sizeof(aData), aData), 100+i*2);
+		EXPECT_EQ(Writer.AddData(sizeof(aData), aData), 100+i*2);
+		EXPECT_EQ(Writer.AddData(sizeof(aData)-sizeof(int), aData), 100+i*2+1);
+	}
+	EXPECT_TRUE(Writer.Finish());
+	EXPECT_TRUE(Reader.Close());
+
+	ASSERT_TRUE(Reader.Open(pStorage, aCopyFilename, IStorage::TYPE_ALL));
+	ASSERT_EQ(Reader.NumData(), 500);
+	for(int i = 0; i < 100; i++)
+	{
+		ASSERT_EQ(Reader.GetDataSize(i), (int)sizeof(aData));
+		const int *pData = (const int *)Reader.GetData(i);
+		for(int k = 0; k < 64; k++)
+			EXPECT_EQ(pData[k], i*k);
+	}
+	EXPECT_TRUE(Reader.Close());
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+	EXPECT_TRUE(pStorage->RemoveFile(aCopyFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, MemoryBudget)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	WriteTestBlocks(pStorage, aFilename, 64);
+
+	CDataFileReader Reader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+	for(int i = 0; i < 64; i++)
+		EXPECT_TRUE(CheckTestBlock(&Reader, i));
+	EXPECT_EQ(Reader.MemoryUsage(), (int64)sizeof(int)*64*65/2);
+
+	// blocks 60-63 take 250 ints, the rest has to go apart from the pinned one
+	Reader.PinData(3);
+	Reader.SetMemoryBudget(sizeof(int)*(250+4));
+	EXPECT_EQ(Reader.MemoryUsage(), (int64)sizeof(int)*(250+4));
+	for(int i = 0; i < 64; i++)
+	{
+		EXPECT_TRUE(CheckTestBlock(&Reader, i));
+		EXPECT_LE(Reader.MemoryUsage(), (int64)sizeof(int)*(250+4) + (i > 60 ? sizeof(int)*(i+1) : 0));
+	}
+
+	// the most recently used blocks stay, the pinned one survives
+	const void *pPinned = Reader.GetData(3);
+	const void *pRecent = Reader.GetData(63);
+	EXPECT_TRUE(CheckTestBlock(&Reader, 40));
+	EXPECT_EQ(Reader.GetData(3), pPinned);
+	EXPECT_EQ(Reader.GetData(63), pRecent);
+	Reader.UnpinData(3);
+
+	// replaced data is never evicted
+	char *pReplace = (char *)mem_alloc(1024);
+	mem_zero(pReplace, 1024);
+	Reader.ReplaceData(10, pReplace, 1024);
+	for(int i = 0; i < 64; i++)
+		EXPECT_TRUE(i == 10 || CheckTestBlock(&Reader, i));
+	EXPECT_EQ(Reader.GetData(10), pReplace);
+
+	Reader.SetMemoryBudget(0);
+	for(int i = 0; i < 64; i++)
+		EXPECT_TRUE(i == 10 || CheckTestBlock(&Reader, i));
+	EXPECT_EQ(Reader.MemoryUsage(), (int64)sizeof(int)*(64*65/2-11));
+
+	// unloading a replaced block brings back the one of the file, it's counted once
+	Reader.UnloadData(10);
+	EXPECT_EQ(Reader.MemoryUsage(), (int64)sizeof(int)*(64*65/2-11));
+	EXPECT_TRUE(CheckTestBlock(&Reader, 10));
+	EXPECT_EQ(Reader.MemoryUsage(), (int64)sizeof(int)*(64*65/2));
+	Reader.UnloadData(10);
+	EXPECT_EQ(Reader.MemoryUsage(), (int64)sizeof(int)*(64*65/2-11));
+	EXPECT_TRUE(Reader.Close());
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, Memory)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	WriteTestBlocks(pStorage, aFilename, 32);
+
+	CDataFileReader Reader;
+	ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+
+	// write a copy with an extra item into memory
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	for(int i = 0; i < Reader.NumData(); i++)
+		Writer.AddData(Reader.GetDataSize(i), Reader.GetData(i));
+	int aItem[3] = {1, 2, 3};
+	Writer.AddItem(5, 6, sizeof(aItem), aItem);
+	EXPECT_TRUE(Writer.Finish());
+	unsigned Size;
+	void *pMemory = Writer.ReleaseMemory(&Size);
+	ASSERT_TRUE(pMemory);
+
+	const SHA256_DIGEST Sha256 = sha256(pMemory, Size);
+	for(int Flags = 0; Flags <= CDataFileReader::OPENFLAG_LAZY_HASH; Flags += CDataFileReader::OPENFLAG_LAZY_HASH)
+	{
+		CDataFileReader MemoryReader;
+		ASSERT_TRUE(MemoryReader.OpenMemory(pMemory, Size, Flags));
+
+		// the items are used in place, changing them doesn't change the hash of the buffer
+		int *pItem = (int *)MemoryReader.FindItem(5, 6);
+		ASSERT_TRUE(pItem);
+		pItem[0] = 7;
+		EXPECT_TRUE(MemoryReader.Sha256() == Sha256);
+		pItem[0] = aItem[0];
+		EXPECT_TRUE(sha256(pMemory, Size) == Sha256);
+
+		ASSERT_EQ(MemoryReader.NumData(), 32);
+		for(int i = 0; i < MemoryReader.NumData(); i++)
+			EXPECT_TRUE(CheckTestBlock(&MemoryReader, i));
+		EXPECT_EQ(mem_comp(MemoryReader.FindItem(5, 6), aItem, sizeof(aItem)), 0);
+		EXPECT_TRUE(MemoryReader.Close());
+	}
+
+	// broken buffers are rejected
+	CDataFileReader MemoryReader;
+	EXPECT_FALSE(MemoryReader.OpenMemory(pMemory, 40));
+	EXPECT_FALSE(MemoryReader.OpenMemory(pMemory, 0));
+
+	// and so are item offsets pointing out of the item data
+	int *pHeader = (int *)pMemory;
+	int *pItemOffsets = pHeader + 9 + pHeader[4]*3;
+	int Offset = pItemOffsets[0];
+	pItemOffsets[0] = pHeader[7]-4;
+	EXPECT_FALSE(MemoryReader.OpenMemory(pMemory, Size));
+	pItemOffsets[0] = -8;
+	EXPECT_FALSE(MemoryReader.OpenMemory(pMemory, Size));
+	pItemOffsets[0] = Offset;
+	EXPECT_TRUE(MemoryReader.OpenMemory(pMemory, Size));
+	EXPECT_TRUE(MemoryReader.Close());
+	mem_free(pMemory);
+	EXPECT_TRUE(Reader.Close());
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+static int BlockingJob(void *pUser)
+{
+	while(!*(volatile bool *)pUser)
+		thread_yield();
+	return 0;
+}
+
+TEST(Datafile, OpenAsync)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+	WriteTestBlocks(pStorage, aFilename, 64);
+
+	CJobPool JobPool;
+	JobPool.Init(1);
+	for(int Flags = 0; Flags <= CDataFileReader::OPENFLAG_MMAP; Flags += CDataFileReader::OPENFLAG_MMAP)
+	{
+		CDataFileReader Reader;
+		Reader.OpenAsync(&JobPool, pStorage, aFilename, IStorage::TYPE_ALL, Flags|CDataFileReader::OPENFLAG_PREFETCH);
+		int LastStatus = CDataFileReader::OPEN_PENDING;
+		while(Reader.OpenStatus() < CDataFileReader::OPEN_DONE)
+		{
+			// the stages only move forward
+			int Status = Reader.OpenStatus();
+			EXPECT_GE(Status, LastStatus);
+			EXPECT_FALSE(Reader.IsOpen());
+			LastStatus = Status;
+			thread_yield();
+		}
+		ASSERT_TRUE(Reader.WaitOpen());
+		EXPECT_EQ(Reader.OpenStatus(), CDataFileReader::OPEN_DONE);
+		EXPECT_TRUE(Reader.IsOpen());
+		for(int i = 0; i < 64; i++)
+			EXPECT_TRUE(CheckTestBlock(&Reader, i));
+
+		CDataFileReader SyncReader;
+		ASSERT_TRUE(SyncReader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+		EXPECT_TRUE(Reader.Sha256() == SyncReader.Sha256());
+		EXPECT_TRUE(Reader.Close());
+		EXPECT_FALSE(Reader.IsOpen());
+	}
+
+	// cancel the open while the pool is still busy
+	{
+		volatile bool Release = false;
+		CJob Blocker;
+		JobPool.Add(&Blocker, BlockingJob, (void *)&Release);
+		CDataFileReader Reader;
+		Reader.OpenAsync(&JobPool, pStorage, aFilename, IStorage::TYPE_ALL);
+		EXPECT_EQ(Reader.OpenStatus(), CDataFileReader::OPEN_PENDING);
+		Reader.CancelOpen();
+		Release = true;
+		EXPECT_FALSE(Reader.WaitOpen());
+		EXPECT_EQ(Reader.OpenStatus(), CDataFileReader::OPEN_CANCELLED);
+		EXPECT_FALSE(Reader.IsOpen());
+
+		// a missing file fails
+		Reader.OpenAsync(&JobPool, pStorage, "does-not-exist.datafile", IStorage::TYPE_ALL);
+		EXPECT_FALSE(Reader.WaitOpen());
+		EXPECT_EQ(Reader.OpenStatus(), CDataFileReader::OPEN_FAILED);
+		while(Blocker.Status() != CJob::STATE_DONE)
+			thread_yield();
+	}
+
+	// a synchronous open stops a pending one first
+	{
+		volatile bool Release = false;
+		CJob Blocker;
+		JobPool.Add(&Blocker, BlockingJob, (void *)&Release);
+		CDataFileReader Reader;
+		Reader.OpenAsync(&JobPool, pStorage, aFilename, IStorage::TYPE_ALL);
+		Release = true;
+		ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+		EXPECT_EQ(Reader.OpenStatus(), CDataFileReader::OPEN_DONE);
+		EXPECT_TRUE(Reader.IsOpen());
+		for(int i = 0; i < 64; i++)
+			EXPECT_TRUE(CheckTestBlock(&Reader, i));
+		EXPECT_TRUE(Reader.Close());
+		while(Blocker.Status() != CJob::STATE_DONE)
+			thread_yield();
+	}
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, CorruptData)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	IStorage *pStorage = CreateTestStorage();
+
+	int aData[1024];
+	for(int i = 0; i < 1024; i++)
+		aData[i] = i*i;
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	Writer.AddData(0, aData);
+	Writer.AddData(sizeof(aData), aData);
+	Writer.AddData(sizeof(aData), aData, CDataFileWriter::COMPRESSION_STORE);
+	Writer.AddData(sizeof(aData)/2, aData);
+	EXPECT_TRUE(Writer.Finish());
+	unsigned Size;
+	char *pMemory = (char *)Writer.ReleaseMemory(&Size);
+
+	// damage the second block and cut the last one short
+	const int *pHeader = (const int *)pMemory;
+	unsigned DataStart = 9*sizeof(int) + pHeader[4]*3*sizeof(int) + (pHeader[5]+2*pHeader[6])*sizeof(int) + pHeader[7];
+	const int *pDataOffsets = (const int *)(pMemory + 9*sizeof(int) + pHeader[4]*3*sizeof(int) + pHeader[5]*sizeof(int));
+	for(int i = 4; i < 12; i++)
+		pMemory[DataStart+pDataOffsets[1]+i] ^= 0x5a;
+	Size -= 4;
+
+	IOHANDLE File = pStorage->OpenFile(aFilename, IOFLAG_WRITE, IStorage::TYPE_SAVE);
+	ASSERT_TRUE(File);
+	io_write(File, pMemory, Size);
+	io_close(File);
+
+	for(int Mode = 0; Mode < 2; Mode++)
+	{
+		CDataFileReader Reader;
+		if(Mode == 0)
+			ASSERT_TRUE(Reader.OpenMemory(pMemory, Size));
+		else
+			ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+		EXPECT_TRUE(Reader.GetData(0) != 0);
+		EXPECT_EQ(Reader.GetDataSize(0), 0);
+		EXPECT_TRUE(Reader.GetData(1) == 0);
+		ASSERT_TRUE(Reader.GetData(2) != 0);
+		EXPECT_EQ(mem_comp(Reader.GetData(2), aData, sizeof(aData)), 0);
+		EXPECT_TRUE(Reader.GetData(3) == 0);
+
+		// blocks that can't be read aren't copied
+		CDataFileWriter Copy;
+		ASSERT_TRUE(Copy.OpenMemory());
+		EXPECT_EQ(Copy.AddDataFrom(&Reader, 2), 0);
+		EXPECT_EQ(Copy.AddDataFrom(&Reader, 3), -1);
+		EXPECT_TRUE(Copy.Finish());
+		EXPECT_TRUE(Reader.Close());
+	}
+
+	mem_free(pMemory);
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, Streaming)
+{
+	CTestInfo Info;
+	char aFilename[64];
+	char aStreamFilename[64];
+	char aSpillFilename[128];
+	Info.Filename(aFilename, sizeof(aFilename), ".datafile");
+	Info.Filename(aStreamFilename, sizeof(aStreamFilename), "-stream.datafile");
+	str_format(aSpillFilename, sizeof(aSpillFilename), "%s.data.tmp", aStreamFilename);
+	IStorage *pStorage = CreateTestStorage();
+	WriteCompressTest(pStorage, aFilename, 0);
+
+	CJobPool JobPool;
+	JobPool.Init(2);
+	for(int Deferred = 0; Deferred < 2; Deferred++)
+	{
+		CDataFileWriter Writer;
+		Writer.SetStreaming(true);
+		ASSERT_TRUE(Writer.Open(pStorage, aStreamFilename, Deferred ? &JobPool : 0));
+		IOHANDLE SpillFile = pStorage->OpenFile(aSpillFilename, IOFLAG_READ, IStorage::TYPE_SAVE);
+		ASSERT_TRUE(SpillFile);
+		io_close(SpillFile);
+
+		int aData[512];
+		for(int i = 0; i < 100; i++)
+		{
+			for(int k = 0; k < 512; k++)
+				aData[k] = (k*i)%7;
+			Writer.AddData(sizeof(int)*(i*5%512+1), aData);
+			if(i == 50)
+				Writer.Flush();
+		}
+		Writer.AddItem(1, 2, sizeof(int), aData);
+		EXPECT_TRUE(Writer.Finish());
+
+		// the spill file is gone and the output is the same as without streaming
+		EXPECT_FALSE(pStorage->OpenFile(aSpillFilename, IOFLAG_READ, IStorage::TYPE_SAVE));
+		CDataFileReader Reader;
+		CDataFileReader StreamReader;
+		ASSERT_TRUE(Reader.Open(pStorage, aFilename, IStorage::TYPE_ALL));
+		ASSERT_TRUE(StreamReader.Open(pStorage, aStreamFilename, IStorage::TYPE_ALL));
+		EXPECT_TRUE(Reader.Sha256() == StreamReader.Sha256());
+		EXPECT_TRUE(Reader.Close());
+		EXPECT_TRUE(StreamReader.Close());
+	}
+
+	// an unfinished writer removes its spill file
+	{
+		CDataFileWriter Writer;
+		Writer.SetStreaming(true);
+		ASSERT_TRUE(Writer.Open(pStorage, aStreamFilename));
+		int aData[64] = {1, 2, 3};
+		Writer.AddData(sizeof(aData), aData);
+	}
+	EXPECT_FALSE(pStorage->OpenFile(aSpillFilename, IOFLAG_READ, IStorage::TYPE_SAVE));
+
+	// losing the spilled data fails the write
+	{
+		CDataFileWriter Writer;
+		Writer.SetStreaming(true);
+		ASSERT_TRUE(Writer.Open(pStorage, aStreamFilename));
+		int aData[64] = {1, 2, 3};
+		Writer.AddData(sizeof(aData), aData);
+		EXPECT_TRUE(pStorage->RemoveFile(aSpillFilename, IStorage::TYPE_SAVE));
+		EXPECT_FALSE(Writer.Finish());
+	}
+
+	EXPECT_TRUE(pStorage->RemoveFile(aFilename, IStorage::TYPE_SAVE));
+	EXPECT_TRUE(pStorage->RemoveFile(aStreamFilename, IStorage::TYPE_SAVE));
+}
+
+TEST(Datafile, TileCodec)
+{
+	// a tilemap with long runs and noise in the skip bytes
+	enum { NUM_TILES=64*64 };
+	unsigned char aTiles[NUM_TILES*4];
+	for(int i = 0; i < NUM_TILES; i++)
+	{
+		aTiles[i*4+0] = (i/64)%5 == 0 ? 1 : (i%64 < 10 ? 0 : i/300);
+		aTiles[i*4+1] = i/1000;
+		aTiles[i*4+2] = i*7;
+		aTiles[i*4+3] = 0;
+	}
+	unsigned char aOdd[7] = {1, 2, 3, 4, 5, 6, 7};
+
+	CJobPool JobPool;
+	JobPool.Init(2);
+	unsigned aSizes[2];
+	for(int Codec = 0; Codec < 2; Codec++)
+	{
+		CDataFileWriter Writer;
+		ASSERT_TRUE(Writer.OpenMemory(Codec ? &JobPool : 0));
+		if(Codec)
+		{
+			Writer.AddTileData(sizeof(aTiles), aTiles);
+			Writer.AddTileData(sizeof(aOdd), aOdd);
+			Writer.AddTileData(0, aTiles);
+		}
+		else
+		{
+			Writer.AddData(sizeof(aTiles), aTiles);
+			Writer.AddData(sizeof(aOdd), aOdd);
+			Writer.AddData(0, aTiles);
+		}
+		EXPECT_TRUE(Writer.Finish());
+		char *pMemory = (char *)Writer.ReleaseMemory(&aSizes[Codec]);
+		EXPECT_EQ(((const int *)pMemory)[1], Codec ? 5 : 4);
+
+		CDataFileReader Reader;
+		ASSERT_TRUE(Reader.OpenMemory(pMemory, aSizes[Codec]));
+		EXPECT_EQ(Reader.GetDataCodec(0), Codec ? DATACODEC_TILES : DATACODEC_NONE);
+		EXPECT_EQ(Reader.GetDataCodec(1), DATACODEC_NONE);
+		ASSERT_EQ(Reader.GetDataSize(0), (int)sizeof(aTiles));
+		const unsigned char *pTiles = (const unsigned char *)Reader.GetData(0);
+		ASSERT_TRUE(pTiles);
+		for(int i = 0; i < NUM_TILES*4; i++)
+		{
+			// the skip bytes are dropped by the codec
+			if(Codec && i%4 == 2)
+				EXPECT_EQ(pTiles[i], 0);
+			else
+				EXPECT_EQ(pTiles[i], aTiles[i]);
+		}
+		ASSERT_EQ(Reader.GetDataSize(1), (int)sizeof(aOdd));
+		EXPECT_EQ(mem_comp(Reader.GetData(1), aOdd, sizeof(aOdd)), 0);
+		EXPECT_EQ(Reader.GetDataSize(2), 0);
+
+		// transformed blocks are passed through raw with their codec
+		const int RawSize = Reader.GetRawDataSize(0);
+		EXPECT_GT(RawSize, 0);
+		CDataFileWriter Copy;
+		ASSERT_TRUE(Copy.OpenMemory());
+		Copy.AddDataFrom(&Reader, 0);
+		EXPECT_TRUE(Copy.Finish());
+		unsigned CopySize;
+		void *pCopy = Copy.ReleaseMemory(&CopySize);
+		CDataFileReader CopyReader;
+		ASSERT_TRUE(CopyReader.OpenMemory(pCopy, CopySize));
+		EXPECT_EQ(CopyReader.GetDataCodec(0), Codec ? DATACODEC_TILES : DATACODEC_NONE);
+		EXPECT_EQ(mem_comp(CopyReader.GetData(0), pTiles, sizeof(aTiles)), 0);
+		ASSERT_EQ(CopyReader.GetRawDataSize(0), RawSize);
+		char *pRaw = (char *)mem_alloc(RawSize*2);
+		int RawUncompressedSize, RawCodec, RawEncodedSize;
+		int CopyUncompressedSize, CopyCodec, CopyEncodedSize;
+		EXPECT_TRUE(Reader.ReadRawData(0, pRaw, RawSize, &RawUncompressedSize, &RawCodec, &RawEncodedSize));
+		EXPECT_TRUE(CopyReader.ReadRawData(0, pRaw+RawSize, RawSize, &CopyUncompressedSize, &CopyCodec, &CopyEncodedSize));
+		EXPECT_EQ(mem_comp(pRaw, pRaw+RawSize, RawSize), 0);
+		EXPECT_EQ(CopyUncompressedSize, RawUncompressedSize);
+		EXPECT_EQ(CopyCodec, RawCodec);
+		EXPECT_EQ(CopyEncodedSize, RawEncodedSize);
+		EXPECT_EQ(RawEncodedSize < RawUncompressedSize, Codec == 1);
+		mem_free(pRaw);
+		EXPECT_TRUE(CopyReader.Close());
+		mem_free(pCopy);
+
+		EXPECT_TRUE(Reader.Close());
+		mem_free(pMemory);
+	}
+	EXPECT_LT(aSizes[1], aSizes[0]);
+}
@@ -63,3 +63,26 @@ TEST(Io, ReadBom6)
 {
 	TestFileRead("\xef\xbb\xbfxyz\xef\xbb\xbf", true, "xyz\xef\xbb\xbf");
 }
+
+TEST(Io, ReadAt)
+{
+	CTestInfo Info;
+	char aBuf[8] = {0};
+	IOHANDLE File = io_open(Info.m_aFilename, IOFLAG_WRITE);
+	ASSERT_TRUE(File);
+	EXPECT_EQ(io_write(File, "0123456789", 10), 10);
+	EXPECT_FALSE(io_close(File));
+	File = io_open(Info.m_aFilename, IOFLAG_READ);
+	ASSERT_TRUE(File);
+	EXPECT_EQ(io_read(File, aBuf, 2), 2);
+	EXPECT_EQ(io_read_at(File, aBuf, 3, 6), 3);
+	EXPECT_TRUE(mem_comp(aBuf, "678", 3) == 0);
+	EXPECT_EQ(io_read_at(File, aBuf, sizeof(aBuf), 8), 2);
+	EXPECT_TRUE(mem_comp(aBuf, "89", 2) == 0);
+	// the file position isn't changed
+	EXPECT_EQ(io_read(File, aBuf, 2), 2);
+	EXPECT_TRUE(mem_comp(aBuf, "23", 2) == 0);
+	EXPECT_FALSE(io_close(File));
+
+	fs_remove(Info.m_aFilename);
+}
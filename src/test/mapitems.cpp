@@ -0,0 +1,232 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+#include <gtest/gtest.h>
+
+#include <engine/map.h>
+#include <engine/shared/datafile.h>
+#include <engine/shared/jobs.h>
+#include <game/layers.h>
+#include <game/mapitemview.h>
+
+#include "testmap.h"
+
+TEST(MapItems, View)
+{
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGroup(&Writer, 0, 1, 0, 1);
+	AddGroup(&Writer, 1, CMapItemGroup::CURRENT_VERSION, 1, 1);
+	CTile aTiles[4] = {{0}};
+	AddTilemap(&Writer, 0, 2, 2, 0, aTiles);
+	CMapItemLayerQuads Quads;
+	mem_zero(&Quads, sizeof(Quads));
+	Quads.m_Layer.m_Type = LAYERTYPE_QUADS;
+	Quads.m_Version = 1;
+	Writer.AddItem(MAPITEMTYPE_LAYER, 1, sizeof(Quads)-sizeof(Quads.m_aName), &Quads);
+	CMapItemImage Image;
+	mem_zero(&Image, sizeof(Image));
+	Image.m_Version = 1;
+	Image.m_Width = 64;
+	Writer.AddItem(MAPITEMTYPE_IMAGE, 0, sizeof(CMapItemImage_v1), &Image);
+	CTestMap Map(&Writer);
+
+	CMapItemView<CMapItemGroup> Groups;
+	Groups.Init(&Map);
+	ASSERT_EQ(Groups.Num(), 2);
+	EXPECT_TRUE(Groups.Get(2) == 0);
+
+	// the v1 group is upgraded with zeroed clipping, the current one is used in place
+	EXPECT_EQ(Groups[0]->m_Version, 1);
+	EXPECT_EQ(Groups[0]->m_OffsetX, 10);
+	EXPECT_EQ(Groups[0]->m_ParallaxY, 50);
+	EXPECT_EQ(Groups[0]->m_UseClipping, 0);
+	EXPECT_EQ(Groups[0]->m_ClipW, 0);
+	EXPECT_TRUE(Groups[1] == Map.GetItem(Groups.Start()+1, 0, 0));
+	EXPECT_EQ(Groups[1]->m_UseClipping, 1);
+	EXPECT_EQ(Groups[1]->m_ClipW, 20);
+
+	CMapItemView<CMapItemLayer> Layers;
+	Layers.Init(&Map);
+	ASSERT_EQ(Layers.Num(), 2);
+	int NumTilemaps = 0;
+	for(CMapItemLayer * const *ppLayer = Layers.begin(); ppLayer != Layers.end(); ppLayer++)
+		NumTilemaps += MapItemTilemap(*ppLayer) != 0;
+	EXPECT_EQ(NumTilemaps, 1);
+	ASSERT_TRUE(MapItemTilemap(Layers[0]));
+	EXPECT_EQ(MapItemTilemap(Layers[0])->m_Width, 2);
+	EXPECT_TRUE(MapItemQuads(Layers[0]) == 0);
+	ASSERT_TRUE(MapItemQuads(Layers[1]));
+	EXPECT_TRUE(Layers[1] != Map.GetItem(Layers.Start()+1, 0, 0));
+	EXPECT_EQ(MapItemQuads(Layers[1])->m_aName[2], 0);
+
+	CMapItemView<CMapItemImage> Images;
+	Images.Init(&Map);
+	ASSERT_EQ(Images.Num(), 1);
+	EXPECT_EQ(Images[0]->m_Width, 64);
+	EXPECT_EQ(Images[0]->m_Format, CImageInfo::FORMAT_RGBA);
+
+	CMapItemView<CMapItemEnvelope> Envelopes;
+	Envelopes.Init(&Map);
+	EXPECT_EQ(Envelopes.Num(), 0);
+	EXPECT_TRUE(Envelopes.begin() == Envelopes.end());
+}
+
+TEST(MapItems, GameLayer)
+{
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGroup(&Writer, 0, 1, 0, 2);
+	CTile aTiles[4] = {{0}};
+	AddTilemap(&Writer, 0, 2, 2, 0, aTiles);
+	AddTilemap(&Writer, 1, 2, 2, TILESLAYERFLAG_GAME, aTiles);
+	CTestMap Map(&Writer);
+
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	EXPECT_EQ(Layers.NumGroups(), 1);
+	EXPECT_EQ(Layers.NumLayers(), 2);
+	ASSERT_TRUE(Layers.GameLayer());
+	EXPECT_TRUE(Layers.GameLayer() == MapItemTilemap(Layers.GetLayer(1)));
+	ASSERT_TRUE(Layers.GameGroup() == Layers.GetGroup(0));
+	EXPECT_EQ(Layers.GameGroup()->m_OffsetX, 0);
+	EXPECT_EQ(Layers.GameGroup()->m_ParallaxX, 100);
+	EXPECT_EQ(Layers.GameGroup()->m_UseClipping, 0);
+
+	// the normalized settings are also in the map item of the upgraded group
+	int Start, Num;
+	Map.GetType(MAPITEMTYPE_GROUP, &Start, &Num);
+	ASSERT_EQ(Map.GetItemSize(Start), (int)sizeof(CMapItemGroup_v1));
+	const CMapItemGroup_v1 *pItem = (const CMapItemGroup_v1 *)Map.GetItem(Start, 0, 0);
+	EXPECT_EQ(pItem->m_OffsetX, 0);
+	EXPECT_EQ(pItem->m_ParallaxX, 100);
+	EXPECT_EQ(pItem->m_ParallaxY, 100);
+	EXPECT_EQ(pItem->m_NumLayers, 2);
+}
+
+TEST(MapItems, LayerIndex)
+{
+	// the second group lists a layer of the first one again, the last layer has no group
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGroup(&Writer, 0, CMapItemGroup::CURRENT_VERSION, 0, 2);
+	AddGroup(&Writer, 1, CMapItemGroup::CURRENT_VERSION, 1, 3);
+	CTile aTiles[4] = {{0}};
+	AddTilemap(&Writer, 0, 2, 2, 0, aTiles);
+	CMapItemLayerQuads Quads;
+	mem_zero(&Quads, sizeof(Quads));
+	Quads.m_Layer.m_Type = LAYERTYPE_QUADS;
+	Quads.m_Version = CMapItemLayerQuads::CURRENT_VERSION;
+	Writer.AddItem(MAPITEMTYPE_LAYER, 1, sizeof(Quads), &Quads);
+	AddTilemap(&Writer, 2, 2, 2, TILESLAYERFLAG_GAME, aTiles);
+	Writer.AddItem(MAPITEMTYPE_LAYER, 3, sizeof(Quads), &Quads);
+	AddTilemap(&Writer, 4, 2, 2, 0, aTiles);
+	CTestMap Map(&Writer);
+
+	CLayers Layers;
+	Layers.Init(0, &Map);
+	ASSERT_EQ(Layers.NumLayers(), 5);
+	EXPECT_EQ(Layers.GetLayerGroup(0), 0);
+	EXPECT_EQ(Layers.GetLayerGroup(1), 0);
+	EXPECT_EQ(Layers.GetLayerGroup(2), 1);
+	EXPECT_EQ(Layers.GetLayerGroup(3), 1);
+	EXPECT_EQ(Layers.GetLayerGroup(4), -1);
+	EXPECT_EQ(Layers.GetLayerGroup(5), -1);
+
+	ASSERT_EQ(Layers.NumTilemaps(), 2);
+	EXPECT_EQ(Layers.GetTilemapLayer(0), 0);
+	EXPECT_EQ(Layers.GetTilemapLayer(1), 2);
+	EXPECT_TRUE(Layers.GetTilemap(1) == Layers.GameLayer());
+	ASSERT_EQ(Layers.NumQuadLayers(), 2);
+	EXPECT_EQ(Layers.GetQuadLayer(0), 1);
+	EXPECT_EQ(Layers.GetQuadLayer(1), 3);
+	EXPECT_TRUE(Layers.GetQuads(0) == MapItemQuads(Layers.GetLayer(1)));
+
+	EXPECT_EQ(Layers.GameLayerIndex(), 2);
+	EXPECT_TRUE(Layers.GameGroup() == Layers.GetGroup(1));
+}
+
+static void ReferenceSkip(CTile *pTiles, int Width, int Height)
+{
+	for(int y = 0; y < Height; y++)
+	{
+		for(int x = 1; x < Width;)
+		{
+			int SkippedX;
+			for(SkippedX = 1; x+SkippedX < Width && SkippedX < 255; SkippedX++)
+			{
+				if(pTiles[y*Width+x+SkippedX].m_Index)
+					break;
+			}
+
+			pTiles[y*Width+x].m_Skip = SkippedX-1;
+			x += SkippedX;
+		}
+	}
+}
+
+TEST(MapItems, TilemapSkip)
+{
+	// sparse and dense rows, wider than the longest skip
+	const int aWidths[3] = {1, 37, 700};
+	const int Height = 8;
+	CTile *apTiles[3];
+	CDataFileWriter Writer;
+	ASSERT_TRUE(Writer.OpenMemory());
+	AddGroup(&Writer, 0, CMapItemGroup::CURRENT_VERSION, 0, 3);
+	unsigned Seed = 1;
+	for(int l = 0; l < 3; l++)
+	{
+		apTiles[l] = (CTile *)mem_alloc(aWidths[l]*Height*sizeof(CTile));
+		mem_zero(apTiles[l], aWidths[l]*Height*sizeof(CTile));
+		for(int i = 0; i < aWidths[l]*Height; i++)
+		{
+			Seed = Seed*1103515245+12345;
+			if((Seed>>16)%(i/aWidths[l]+1) == 0)
+				apTiles[l][i].m_Index = (Seed>>8)&0xff;
+			apTiles[l][i].m_Skip = 77;
+		}
+		AddTilemap(&Writer, l, aWidths[l], Height, 0, apTiles[l]);
+		ReferenceSkip(apTiles[l], aWidths[l], Height);
+	}
+	CTestMap Map(&Writer);
+
+	CJobPool Pool;
+	Pool.Init(2);
+	for(int Parallel = 0; Parallel < 2; Parallel++)
+	{
+		CLayers Layers;
+		Layers.Init(0, &Map);
+		if(Parallel)
+			Layers.InitTilemapSkip(&Pool);
+		EXPECT_TRUE(Layers.GetTiles(-1) == 0);
+		EXPECT_TRUE(Layers.GetTiles(3) == 0);
+		for(int l = 0; l < 3; l++)
+		{
+			CTile *pTiles = Layers.GetTiles(l);
+			ASSERT_TRUE(pTiles);
+			EXPECT_TRUE(pTiles == Map.GetData(l));
+			EXPECT_EQ(mem_comp(pTiles, apTiles[l], aWidths[l]*Height*sizeof(CTile)), 0);
+		}
+	}
+
+	// the pins are released on the next init, so the tiles can be unloaded
+	Map.Reader()->SetMemoryBudget(1);
+	{
+		CLayers Layers;
+		Layers.Init(0, &Map);
+		ASSERT_TRUE(Layers.GetTiles(2));
+		EXPECT_EQ(Map.Reader()->MemoryUsage(), (int64)(aWidths[2]*Height*sizeof(CTile)));
+		Layers.Init(0, &Map);
+		EXPECT_EQ(Map.Reader()->MemoryUsage(), 0);
+
+		// the pins of a reloaded map are gone, they are not dropped again
+		ASSERT_TRUE(Layers.GetTiles(2));
+		Map.Reload();
+		Layers.Init(0, &Map);
+		ASSERT_TRUE(Layers.GetTiles(2));
+		EXPECT_EQ(Map.Reader()->MemoryUsage(), (int64)(aWidths[2]*Height*sizeof(CTile)));
+	}
+
+	for(int l = 0; l < 3; l++)
+		mem_free(apTiles[l]);
+}
@@ -0,0 +1,79 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+#ifndef TEST_TESTMAP_H
+#define TEST_TESTMAP_H
+
+#include <engine/map.h>
+#include <engine/shared/datafile.h>
+#include <game/mapitems.h>
+
+// serves the items of a datafile in memory
+class CTestMap : public IMap
+{
+	CDataFileReader m_Reader;
+	void *m_pMemory;
+	unsigned m_Size;
+
+public:
+	CTestMap(CDataFileWriter *pWriter)
+	{
+		pWriter->Finish();
+		m_pMemory = pWriter->ReleaseMemory(&m_Size);
+		m_Reader.OpenMemory(m_pMemory, m_Size);
+	}
+	~CTestMap()
+	{
+		m_Reader.Close();
+		mem_free(m_pMemory);
+	}
+
+	virtual void *GetData(int Index) { return m_Reader.GetData(Index); }
+	virtual void *GetDataSwapped(int Index) { return m_Reader.GetDataSwapped(Index); }
+	virtual void UnloadData(int Index) { m_Reader.UnloadData(Index); }
+	virtual void PinData(int Index) { m_Reader.PinData(Index); }
+	virtual void UnpinData(int Index) { m_Reader.UnpinData(Index); }
+	virtual unsigned Serial() { return m_Reader.Serial(); }
+	virtual void *GetItem(int Index, int *pType, int *pID) { return m_Reader.GetItem(Index, pType, pID); }
+	virtual int GetItemSize(int Index) { return m_Reader.GetItemSize(Index); }
+	virtual void GetType(int Type, int *pStart, int *pNum) { m_Reader.GetType(Type, pStart, pNum); }
+	virtual void *FindItem(int Type, int ID) { return m_Reader.FindItem(Type, ID); }
+	virtual int NumItems() { return m_Reader.NumItems(); }
+
+	CDataFileReader *Reader() { return &m_Reader; }
+	// opens the buffer again, like loading a new map
+	void Reload()
+	{
+		m_Reader.Close();
+		m_Reader.OpenMemory(m_pMemory, m_Size);
+	}
+};
+
+inline void AddGroup(CDataFileWriter *pWriter, int ID, int Version, int StartLayer, int NumLayers)
+{
+	CMapItemGroup Group;
+	mem_zero(&Group, sizeof(Group));
+	Group.m_Version = Version;
+	Group.m_OffsetX = 10;
+	Group.m_ParallaxX = 50;
+	Group.m_ParallaxY = 50;
+	Group.m_StartLayer = StartLayer;
+	Group.m_NumLayers = NumLayers;
+	Group.m_UseClipping = 1;
+	Group.m_ClipW = 20;
+	pWriter->AddItem(MAPITEMTYPE_GROUP, ID, Version < 2 ? sizeof(CMapItemGroup_v1) : sizeof(Group), &Group);
+}
+
+inline void AddTilemap(CDataFileWriter *pWriter, int ID, int Width, int Height, int Flags, const CTile *pTiles)
+{
+	CMapItemLayerTilemap Tilemap;
+	mem_zero(&Tilemap, sizeof(Tilemap));
+	Tilemap.m_Layer.m_Type = LAYERTYPE_TILES;
+	Tilemap.m_Version = CMapItemLayerTilemap::CURRENT_VERSION;
+	Tilemap.m_Width = Width;
+	Tilemap.m_Height = Height;
+	Tilemap.m_Flags = Flags;
+	Tilemap.m_Data = pWriter->AddData(Width*Height*sizeof(CTile), pTiles);
+	pWriter->AddItem(MAPITEMTYPE_LAYER, ID, sizeof(Tilemap), &Tilemap);
+}
+
+#endif // TEST_TESTMAP_H
@@ -0,0 +1,210 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+#include <base/math.h>
+#include <base/system.h>
+#include <engine/shared/datafile.h>
+#include <engine/shared/jsonwriter.h>
+#include <engine/storage.h>
+
+// dumps the layout of a datafile and times loading and saving it as json
+static int64 Elapsed(int64 Start)
+{
+	return (time_get()-Start)*1000000/time_freq();
+}
+
+static void WriteInt(CJsonWriter *pJson, const char *pName, int Value)
+{
+	pJson->WriteAttribute(pName);
+	pJson->WriteIntValue(Value);
+}
+
+static void WriteStr(CJsonWriter *pJson, const char *pName, const char *pValue)
+{
+	pJson->WriteAttribute(pName);
+	pJson->WriteStrValue(pValue);
+}
+
+static void WriteItemTypes(CJsonWriter *pJson, CDataFileReader *pReader)
+{
+	// the items of a type are stored next to each other
+	pJson->WriteAttribute("item_types");
+	pJson->BeginArray();
+	for(int i = 0; i < pReader->NumItems();)
+	{
+		int Type, ID;
+		pReader->GetItem(i, &Type, &ID);
+		int Start, Num;
+		pReader->GetType(Type, &Start, &Num);
+		int Size = 0;
+		for(int k = Start; k < Start+Num; k++)
+			Size += pReader->GetItemSize(k);
+
+		pJson->BeginObject();
+		WriteInt(pJson, "type", Type);
+		WriteInt(pJson, "start", Start);
+		WriteInt(pJson, "num", Num);
+		WriteInt(pJson, "size", Size);
+		pJson->EndObject();
+		i = Start+Num > i ? Start+Num : i+1;
+	}
+	pJson->EndArray();
+}
+
+static void WriteDatas(CJsonWriter *pJson, CDataFileReader *pReader)
+{
+	pJson->WriteAttribute("data");
+	pJson->BeginArray();
+	for(int i = 0; i < pReader->NumData(); i++)
+	{
+		int Compressed = pReader->GetFileDataSize(i);
+		int Uncompressed = pReader->GetDataSize(i);
+		pJson->BeginObject();
+		WriteInt(pJson, "index", i);
+		WriteInt(pJson, "codec", pReader->GetDataCodec(i));
+		WriteInt(pJson, "compressed_size", Compressed);
+		WriteInt(pJson, "uncompressed_size", Uncompressed);
+		WriteInt(pJson, "ratio_permille", Uncompressed > 0 ? (int)((int64)Compressed*1000/Uncompressed) : 1000);
+		pJson->EndObject();
+	}
+	pJson->EndArray();
+}
+
+// -1 if a block can't be read
+static int64 TimeResave(CDataFileReader *pReader, unsigned *pSize)
+{
+	// recompress everything into memory, the disk would only add noise
+	int64 Start = time_get();
+	CDataFileWriter Writer;
+	Writer.OpenMemory();
+	for(int i = 0; i < pReader->NumData(); i++)
+	{
+		void *pData = pReader->GetData(i);
+		if(!pData)
+		{
+			Writer.Finish();
+			mem_free(Writer.ReleaseMemory(pSize));
+			*pSize = 0;
+			return -1;
+		}
+		if(pReader->GetDataCodec(i) == DATACODEC_TILES)
+			Writer.AddTileData(pReader->GetDataSize(i), pData);
+		else
+			Writer.AddData(pReader->GetDataSize(i), pData);
+	}
+	for(int i = 0; i < pReader->NumItems(); i++)
+	{
+		int Type, ID;
+		void *pItem = pReader->GetItem(i, &Type, &ID);
+		Writer.AddItem(Type, ID, pReader->GetItemSize(i), pItem);
+	}
+	Writer.Finish();
+	int64 Time = Elapsed(Start);
+	mem_free(Writer.ReleaseMemory(pSize));
+	return Time;
+}
+
+int main(int argc, const char **argv)
+{
+	cmdline_fix(&argc, &argv);
+
+	if(argc < 2)
+	{
+		dbg_logger_stdout();
+		dbg_msg("map_inspect", "usage: %s <map> [runs], the map is looked up in the storage paths", argv[0]);
+		cmdline_free(argc, argv);
+		return -1;
+	}
+	const char *pFilename = argv[1];
+	int Runs = argc > 2 ? maximum(str_toint(argv[2]), 1) : 1;
+
+	IStorage *pStorage = CreateStorage("Teeworlds", IStorage::STORAGETYPE_BASIC, argc, argv);
+	CDataFileReader Reader;
+	if(!pStorage || !Reader.Open(pStorage, pFilename, IStorage::TYPE_ALL))
+	{
+		dbg_logger_stdout();
+		dbg_msg("map_inspect", "failed to open '%s'", pFilename);
+		delete pStorage;
+		cmdline_free(argc, argv);
+		return -1;
+	}
+
+	// take the best of all runs for every step
+	int64 OpenTime = -1, HashTime = -1, LoadTime = -1, ResaveTime = -1;
+	unsigned ResaveSize = 0;
+	for(int r = 0; r < Runs; r++)
+	{
+		CDataFileReader TimedReader;
+		int64 Start = time_get();
+		if(!TimedReader.Open(pStorage, pFilename, IStorage::TYPE_ALL, CDataFileReader::OPENFLAG_LAZY_HASH))
+		{
+			dbg_logger_stdout();
+			dbg_msg("map_inspect", "failed to open '%s' again", pFilename);
+			Reader.Close();
+			delete pStorage;
+			cmdline_free(argc, argv);
+			return -1;
+		}
+		int64 Time = Elapsed(Start);
+		OpenTime = OpenTime < 0 ? Time : minimum(OpenTime, Time);
+
+		Start = time_get();
+		TimedReader.Sha256();
+		Time = Elapsed(Start);
+		HashTime = HashTime < 0 ? Time : minimum(HashTime, Time);
+
+		Start = time_get();
+		for(int i = 0; i < TimedReader.NumData(); i++)
+			TimedReader.GetData(i);
+		Time = Elapsed(Start);
+		LoadTime = LoadTime < 0 ? Time : minimum(LoadTime, Time);
+
+		Time = TimeResave(&TimedReader, &ResaveSize);
+		if(Time < 0)
+		{
+			dbg_msg("map_inspect", "failed to read all data blocks, no resave timing");
+			ResaveTime = -1;
+			Runs = r+1;
+			break;
+		}
+		ResaveTime = ResaveTime < 0 ? Time : minimum(ResaveTime, Time);
+	}
+
+	char aSha256[SHA256_MAXSTRSIZE];
+	sha256_str(Reader.Sha256(), aSha256, sizeof(aSha256));
+	int FileSize = 0;
+	IOHANDLE File = pStorage->OpenFile(pFilename, IOFLAG_READ, IStorage::TYPE_ALL);
+	if(File)
+	{
+		FileSize = io_length(File);
+		io_close(File);
+	}
+	int UncompressedSize = 0;
+	for(int i = 0; i < Reader.NumData(); i++)
+		UncompressedSize += Reader.GetDataSize(i);
+
+	CJsonWriter Json(io_stdout());
+	Json.BeginObject();
+	WriteStr(&Json, "file", pFilename);
+	WriteInt(&Json, "size", FileSize);
+	WriteStr(&Json, "sha256", aSha256);
+	WriteInt(&Json, "num_items", Reader.NumItems());
+	WriteInt(&Json, "num_data", Reader.NumData());
+	WriteInt(&Json, "uncompressed_size", UncompressedSize);
+	WriteItemTypes(&Json, &Reader);
+	WriteDatas(&Json, &Reader);
+	Json.WriteAttribute("timings_us");
+	Json.BeginObject();
+	WriteInt(&Json, "runs", Runs);
+	WriteInt(&Json, "open", (int)OpenTime);
+	WriteInt(&Json, "hash", (int)HashTime);
+	WriteInt(&Json, "decompress", (int)LoadTime);
+	WriteInt(&Json, "resave", (int)ResaveTime);
+	Json.EndObject();
+	WriteInt(&Json, "resave_size", ResaveSize);
+	Json.EndObject();
+
+	Reader.Close();
+	delete pStorage;
+	cmdline_free(argc, argv);
+	return 0;
+}